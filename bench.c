@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cdba.h"
+#include "circ_buf.h"
+#include "msg.h"
+
+/*
+ * Microbenchmarks for the framing and receive buffer code shared by cdba and
+ * cdba-server. Build with "make bench" and run ./cdba-bench; each case runs
+ * for about BENCH_SECONDS and reports its throughput. The bytewise cases copy
+ * the data as the original circ_read() did and are the baseline to compare
+ * the other cases against.
+ */
+
+#define BENCH_SECONDS	1.0
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Fill @circ with as many frames of @len bytes payload as fit */
+static size_t bench_fill_frames(struct circ_buf *circ, const void *payload, size_t len)
+{
+	char hdr[MSG_HDR_MAX];
+	size_t hdr_len;
+	size_t count = 0;
+
+	hdr_len = msg_hdr_encode(hdr, MSG_CONSOLE, len);
+
+	while (CIRC_SPACE(circ) >= hdr_len + len) {
+		circ_write(circ, hdr, hdr_len);
+		circ_write(circ, payload, len);
+		count++;
+	}
+
+	return count;
+}
+
+/* Ways of getting the data out of the ring */
+enum bench_mode {
+	BENCH_BYTEWISE,		/* the original circ_read(), a byte at a time */
+	BENCH_COPY,		/* circ_read() */
+	BENCH_IN_PLACE,		/* msg_frame_next() or circ_data_iov() */
+};
+
+/* circ_read() as it was before it copied with memcpy() */
+static size_t bench_read_bytewise(struct circ_buf *circ, void *buf, size_t len)
+{
+	char *p = buf;
+
+	while (len--) {
+		if (circ->tail == circ->head)
+			return 0;
+
+		*p++ = circ->buf[circ->tail];
+
+		circ->tail = (circ->tail + 1) & (circ->size - 1);
+	}
+
+	return (void *)p - buf;
+}
+
+/* Frame extraction as done before msg_frame_next(), copying each payload */
+static bool bench_frame_copy(struct circ_buf *circ, struct msg_hdr *hdr, void **data,
+			     enum bench_mode mode)
+{
+	if (!msg_hdr_decode(circ, hdr))
+		return false;
+
+	*data = malloc(hdr->len);
+	if (!*data)
+		err(1, "failed to allocate frame");
+
+	circ_consume(circ, hdr->size);
+	if (mode == BENCH_BYTEWISE)
+		bench_read_bytewise(circ, *data, hdr->len);
+	else
+		circ_read(circ, *data, hdr->len);
+
+	return true;
+}
+
+static void bench_frames(const char *name, size_t len, bool mirror, enum bench_mode mode)
+{
+	struct circ_buf circ;
+	struct msg_hdr hdr;
+	const void *data;
+	unsigned long frames = 0;
+	volatile uint8_t sink = 0;
+	void *payload;
+	void *buf;
+	double start;
+	double elapsed;
+
+	if (circ_init(&circ, CIRC_BUF_SIZE, mirror) < 0)
+		err(1, "failed to allocate ring");
+
+	payload = calloc(1, len);
+	if (!payload)
+		err(1, "failed to allocate payload");
+
+	/* Offset the frames, so that they wrap around the end of the ring */
+	circ_write(&circ, payload, 7);
+	circ_consume(&circ, 7);
+
+	start = bench_now();
+	do {
+		bench_fill_frames(&circ, payload, len);
+
+		if (mode != BENCH_IN_PLACE) {
+			while (bench_frame_copy(&circ, &hdr, &buf, mode)) {
+				sink ^= *(uint8_t *)buf;
+				free(buf);
+				frames++;
+			}
+		} else {
+			while (msg_frame_next(&circ, &hdr, &data)) {
+				sink ^= *(const uint8_t *)data;
+				frames++;
+			}
+		}
+
+		elapsed = bench_now() - start;
+	} while (elapsed < BENCH_SECONDS);
+
+	printf("%-44s %12.0f frames/s %10.1f MB/s\n", name,
+	       frames / elapsed, frames * len / elapsed / 1e6);
+
+	free(payload);
+	circ_destroy(&circ);
+}
+
+/* Drain a full ring in @len byte reads, either copied out or viewed in place */
+static void bench_ring(const char *name, size_t len, bool mirror, enum bench_mode mode)
+{
+	struct circ_buf circ;
+	struct iovec iov[2];
+	unsigned long bytes = 0;
+	volatile uint8_t sink = 0;
+	void *payload;
+	void *buf;
+	double start;
+	double elapsed;
+	int count;
+	int i;
+
+	if (circ_init(&circ, CIRC_BUF_SIZE, mirror) < 0)
+		err(1, "failed to allocate ring");
+
+	payload = calloc(1, CIRC_BUF_SIZE);
+	buf = malloc(len);
+	if (!payload || !buf)
+		err(1, "failed to allocate buffers");
+
+	/* Offset the reads, so that they wrap around the end of the ring */
+	circ_write(&circ, payload, 7);
+	circ_consume(&circ, 7);
+
+	start = bench_now();
+	do {
+		circ_write(&circ, payload, CIRC_SPACE(&circ));
+
+		if (mode == BENCH_BYTEWISE) {
+			while (bench_read_bytewise(&circ, buf, len) == len) {
+				sink ^= *(uint8_t *)buf;
+				bytes += len;
+			}
+		} else if (mode == BENCH_COPY) {
+			while (circ_read(&circ, buf, len) == len) {
+				sink ^= *(uint8_t *)buf;
+				bytes += len;
+			}
+		} else {
+			while ((count = circ_data_iov(&circ, 0, len, iov)) > 0) {
+				for (i = 0; i < count; i++)
+					sink ^= *(uint8_t *)iov[i].iov_base;
+				circ_consume(&circ, len);
+				bytes += len;
+			}
+		}
+
+		/* Drop the partial read left at the end of the ring */
+		circ_consume(&circ, CIRC_AVAIL(&circ));
+
+		elapsed = bench_now() - start;
+	} while (elapsed < BENCH_SECONDS);
+
+	printf("%-44s %10.1f MB/s\n", name, bytes / elapsed / 1e6);
+
+	free(buf);
+	free(payload);
+	circ_destroy(&circ);
+}
+
+int main(int argc, char **argv)
+{
+	static const size_t sizes[] = { 64, MSG_V1_BULK_LEN, MSG_V2_BULK_LEN };
+	char name[64];
+	size_t i;
+
+	msg_set_version(CDBA_PROTOCOL_V2, MSG_V2_LEN_MAX);
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		snprintf(name, sizeof(name), "frames %zuB, malloc + bytewise read", sizes[i]);
+		bench_frames(name, sizes[i], false, BENCH_BYTEWISE);
+
+		snprintf(name, sizeof(name), "frames %zuB, malloc + circ_read", sizes[i]);
+		bench_frames(name, sizes[i], false, BENCH_COPY);
+
+		snprintf(name, sizeof(name), "frames %zuB, msg_frame_next", sizes[i]);
+		bench_frames(name, sizes[i], false, BENCH_IN_PLACE);
+
+		snprintf(name, sizeof(name), "frames %zuB, msg_frame_next, mirrored", sizes[i]);
+		bench_frames(name, sizes[i], true, BENCH_IN_PLACE);
+	}
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		snprintf(name, sizeof(name), "ring %zuB reads, bytewise read", sizes[i]);
+		bench_ring(name, sizes[i], false, BENCH_BYTEWISE);
+
+		snprintf(name, sizeof(name), "ring %zuB reads, circ_read", sizes[i]);
+		bench_ring(name, sizes[i], false, BENCH_COPY);
+
+		snprintf(name, sizeof(name), "ring %zuB reads, circ_data_iov", sizes[i]);
+		bench_ring(name, sizes[i], false, BENCH_IN_PLACE);
+
+		snprintf(name, sizeof(name), "ring %zuB reads, circ_data_iov, mirrored", sizes[i]);
+		bench_ring(name, sizes[i], true, BENCH_IN_PLACE);
+	}
+
+	return 0;
+}
@@ -0,0 +1,332 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "image.h"
+
+/*
+ * Content addressed cache of booted images, shared between all sessions on
+ * the host. Each image is stored in a file named by the hex encoded SHA-256
+ * digest of its content. The modification time of the files are bumped on
+ * use and the least recently used images are evicted when the total size of
+ * the cache exceeds CACHE_SIZE_MAX.
+ */
+
+struct cache_entry {
+	char name[SHA256_DIGEST_SIZE * 2 + 1];
+	time_t mtime;
+	off_t size;
+};
+
+const char *cache_dir(void)
+{
+	static char path[PATH_MAX];
+	static bool initialized;
+	const char *base;
+	const char *home;
+	int n;
+
+	if (initialized)
+		return path[0] ? path : NULL;
+
+	initialized = true;
+
+	base = getenv("XDG_CACHE_HOME");
+	if (base) {
+		n = snprintf(path, sizeof(path), "%s", base);
+	} else {
+		home = getenv("HOME");
+		if (!home)
+			goto disable;
+
+		n = snprintf(path, sizeof(path), "%s/.cache", home);
+	}
+
+	if (n >= sizeof(path))
+		goto disable;
+
+	/* The base cache directory might not exist yet either */
+	mkdir(path, 0755);
+
+	n += snprintf(path + n, sizeof(path) - n, "/cdba");
+	if (n >= sizeof(path))
+		goto disable;
+
+	if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+		warn("unable to create image cache %s", path);
+		goto disable;
+	}
+
+	return path;
+
+disable:
+	path[0] = '\0';
+	return NULL;
+}
+
+static void cache_name(const uint8_t *digest, char *name)
+{
+	int i;
+
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+		sprintf(name + i * 2, "%02x", digest[i]);
+}
+
+static int cache_path(const uint8_t *digest, char *path, size_t len)
+{
+	char name[SHA256_DIGEST_SIZE * 2 + 1];
+	const char *dir = cache_dir();
+	int n;
+
+	if (!dir)
+		return -ENOENT;
+
+	cache_name(digest, name);
+
+	n = snprintf(path, len, "%s/%s", dir, name);
+	if (n >= len)
+		return -ENAMETOOLONG;
+
+	return 0;
+}
+
+/**
+ * cache_lookup() - find image in cache
+ * @digest:	SHA-256 digest of the requested image
+ *
+ * Return: image object of the cached image, or NULL if not found
+ */
+struct image *cache_lookup(const uint8_t *digest)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	if (cache_path(digest, path, sizeof(path)) < 0)
+		return NULL;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	/* Mark the entry as recently used */
+	futimens(fd, NULL);
+
+	return image_open(fd);
+}
+
+/**
+ * cache_alloc() - allocate an image suitable for cache_store()
+ * @size:	size of the image
+ *
+ * Return: image staging object, spilled to the cache directory
+ */
+struct image *cache_alloc(size_t size)
+{
+	return image_alloc(size, cache_dir());
+}
+
+static int cache_entry_cmp(const void *a, const void *b)
+{
+	const struct cache_entry *ea = a;
+	const struct cache_entry *eb = b;
+
+	if (ea->mtime < eb->mtime)
+		return -1;
+
+	return ea->mtime > eb->mtime;
+}
+
+static void cache_evict(const char *dir)
+{
+	struct cache_entry *entries = NULL;
+	struct cache_entry *tmp;
+	unsigned long long total = 0;
+	struct dirent *de;
+	size_t count = 0;
+	size_t i;
+	struct stat sb;
+	DIR *dp;
+	int dfd;
+
+	dp = opendir(dir);
+	if (!dp)
+		return;
+
+	dfd = dirfd(dp);
+
+	while ((de = readdir(dp)) != NULL) {
+		if (strlen(de->d_name) != SHA256_DIGEST_SIZE * 2)
+			continue;
+
+		if (fstatat(dfd, de->d_name, &sb, 0) < 0 || !S_ISREG(sb.st_mode))
+			continue;
+
+		tmp = realloc(entries, (count + 1) * sizeof(*entries));
+		if (!tmp)
+			break;
+		entries = tmp;
+
+		strcpy(entries[count].name, de->d_name);
+		entries[count].mtime = sb.st_mtime;
+		entries[count].size = sb.st_size;
+		total += sb.st_size;
+		count++;
+	}
+
+	if (total > CACHE_SIZE_MAX) {
+		qsort(entries, count, sizeof(*entries), cache_entry_cmp);
+
+		for (i = 0; i < count && total > CACHE_SIZE_MAX; i++) {
+			if (unlinkat(dfd, entries[i].name, 0) == 0)
+				total -= entries[i].size;
+		}
+	}
+
+	free(entries);
+	closedir(dp);
+}
+
+/**
+ * cache_store() - insert a completely received image into the cache
+ * @image:	image object, allocated using cache_alloc()
+ * @digest:	SHA-256 digest of the content of @image
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int cache_store(struct image *image, const uint8_t *digest)
+{
+	char path[PATH_MAX];
+	int ret;
+
+	ret = cache_path(digest, path, sizeof(path));
+	if (ret < 0)
+		return ret;
+
+	ret = image_link(image, path);
+	if (ret < 0 && ret != -EEXIST)
+		return ret;
+
+	cache_evict(cache_dir());
+
+	return 0;
+}
+
+static int cache_last_path(const char *board, char *path, size_t len)
+{
+	const char *dir = cache_dir();
+	char *p;
+	int n;
+
+	if (!dir)
+		return -ENOENT;
+
+	n = snprintf(path, len, "%s/last-", dir);
+	p = path + n;
+
+	n = snprintf(p, len - n, "%s", board);
+	if (n >= len - (p - path))
+		return -ENAMETOOLONG;
+
+	/* Don't let the board name escape the cache directory */
+	for (; *p; p++) {
+		if (*p == '/')
+			*p = '_';
+	}
+
+	return 0;
+}
+
+/**
+ * cache_set_last() - record the image most recently booted on a board
+ * @board:	name of the board
+ * @digest:	SHA-256 digest of the cached image
+ */
+void cache_set_last(const char *board, const uint8_t *digest)
+{
+	char name[SHA256_DIGEST_SIZE * 2 + 1];
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	int ret;
+
+	ret = cache_last_path(board, path, sizeof(path));
+	if (ret < 0)
+		return;
+
+	ret = snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	if (ret >= sizeof(tmp))
+		return;
+
+	cache_name(digest, name);
+
+	unlink(tmp);
+	ret = symlink(name, tmp);
+	if (ret < 0)
+		return;
+
+	ret = rename(tmp, path);
+	if (ret < 0)
+		unlink(tmp);
+}
+
+/**
+ * cache_lookup_last() - find the image most recently booted on a board
+ * @board:	name of the board
+ *
+ * Return: image object of the cached image, or NULL if not found
+ */
+struct image *cache_lookup_last(const char *board)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	if (cache_last_path(board, path, sizeof(path)) < 0)
+		return NULL;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	return image_open(fd);
+}
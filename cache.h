@@ -0,0 +1,20 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdint.h>
+
+#include "sha256.h"
+
+/* Upper bound of the total size of cached images */
+#define CACHE_SIZE_MAX	(4ULL * 1024 * 1024 * 1024)
+
+struct image;
+
+const char *cache_dir(void);
+struct image *cache_lookup(const uint8_t *digest);
+struct image *cache_alloc(size_t size);
+int cache_store(struct image *image, const uint8_t *digest);
+void cache_set_last(const char *board, const uint8_t *digest);
+struct image *cache_lookup_last(const char *board);
+
+#endif
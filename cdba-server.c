@@ -28,26 +28,40 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#include <sys/epoll.h>
 #include <sys/time.h>
-#include <alloca.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <endian.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "cache.h"
 #include "cdba-server.h"
 #include "circ_buf.h"
+#include "daemon.h"
+#include "delta.h"
 #include "device.h"
 #include "device_parser.h"
 #include "fastboot.h"
+#include "image.h"
 #include "list.h"
+#include "msg.h"
+#include "sha256.h"
 
 static bool quit_invoked;
 
+static bool fastboot_present;
+static void fastboot_boot_deferred(void *data);
+
 struct device *selected_device;
 
 int tty_open(const char *tty, struct termios *old)
@@ -78,19 +92,221 @@ int tty_open(const char *tty, struct termios *old)
 	return fd;
 }
 
+/* Room for the frame header and the largest payload iovec array used */
+#define CDBA_SEND_IOV_MAX	4
+
+/*
+ * Frames the client isn't ready to accept are queued, rather than blocking
+ * the server. Console output beyond the high-water mark is dropped, so that
+ * the capture keeps draining the serial ports; the space above it is kept
+ * for control messages, which are never dropped.
+ */
+#define CDBA_OUTQ_SIZE		(1024 * 1024)
+#define CDBA_OUTQ_HIGH_WATER	(256 * 1024)
+
+static struct circ_buf outq;
+
+static bool outq_dropping;
+static unsigned long outq_overflows;
+static unsigned long outq_dropped_frames;
+static unsigned long outq_dropped_bytes;
+
+static void outq_report(void)
+{
+	warnx("client too slow, dropped %lu console frames (%lu bytes) in %lu overflows",
+	      outq_dropped_frames, outq_dropped_bytes, outq_overflows);
+}
+
+/* Write as much of the output queue as the client accepts */
+static int outq_flush(int fd, void *data)
+{
+	struct iovec iov[2];
+	ssize_t n;
+	int count;
+
+	while (CIRC_AVAIL(&outq)) {
+		count = circ_data_iov(&outq, 0, CIRC_AVAIL(&outq), iov);
+
+		n = writev(STDOUT_FILENO, iov, count);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0 && errno == EAGAIN) {
+			return 0;
+		} else if (n < 0) {
+			/* The client is gone, nothing more will be delivered */
+			circ_consume(&outq, CIRC_AVAIL(&outq));
+			break;
+		}
+
+		circ_consume(&outq, n);
+	}
+
+	watch_del_writefd(STDOUT_FILENO);
+
+	if (outq_dropping) {
+		outq_report();
+		outq_dropping = false;
+	}
+
+	return 0;
+}
+
+/* Time given to a client to take the remaining output as the session ends */
+#define CDBA_OUTQ_DRAIN_MS	5000
+
+static void outq_drop(const char *reason)
+{
+	warnx("%s, dropping %zu bytes of output", reason, CIRC_AVAIL(&outq));
+	circ_consume(&outq, CIRC_AVAIL(&outq));
+
+	watch_del_writefd(STDOUT_FILENO);
+
+	if (outq_overflows)
+		outq_report();
+	outq_dropping = false;
+}
+
+static int64_t outq_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Block until the output queue has room for @len bytes. The queue is dropped
+ * if the client hangs up, or hasn't made room within @timeout ms; a negative
+ * @timeout waits for as long as the client stays connected.
+ */
+static void outq_wait(size_t len, int timeout)
+{
+	struct pollfd pfd = { STDOUT_FILENO, POLLOUT };
+	int64_t deadline = outq_now_ms() + timeout;
+	int left = -1;
+	int ret;
+
+	while (CIRC_AVAIL(&outq) && CIRC_SPACE(&outq) < len) {
+		if (timeout >= 0)
+			left = MAX(deadline - outq_now_ms(), 0);
+
+		ret = poll(&pfd, 1, left);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		} else if (ret == 0) {
+			outq_drop("client stopped reading");
+			return;
+		} else if (ret < 0 || pfd.revents & (POLLERR | POLLHUP)) {
+			outq_drop("client went away");
+			return;
+		}
+
+		outq_flush(STDOUT_FILENO, NULL);
+	}
+}
+
+/**
+ * cdba_sendv() - send a message to the client
+ * @type:	message type
+ * @data:	payload fragments
+ * @count:	number of entries in @data
+ *
+ * The frame is written with a single writev() when nothing is queued ahead
+ * of it, and whatever the client doesn't accept right away is queued and
+ * written once stdout becomes writable. Console output is dropped while the
+ * queue is above its high-water mark.
+ */
+void cdba_sendv(int type, const struct iovec *data, int count)
+{
+	struct iovec iov[CDBA_SEND_IOV_MAX + 1];
+	struct iovec *p = iov;
+	char hdr[MSG_HDR_MAX];
+	size_t total;
+	size_t len = 0;
+	ssize_t n = 0;
+	int i;
+
+	if (count > CDBA_SEND_IOV_MAX)
+		errx(1, "too many fragments in message");
+
+	for (i = 0; i < count; i++) {
+		iov[i + 1] = data[i];
+		len += data[i].iov_len;
+	}
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = msg_hdr_encode(hdr, type, len);
+	count++;
+
+	total = iov[0].iov_len + len;
+
+	if (type == MSG_CONSOLE && CIRC_AVAIL(&outq) + total > CDBA_OUTQ_HIGH_WATER) {
+		if (!outq_dropping)
+			outq_overflows++;
+
+		outq_dropping = true;
+		outq_dropped_frames++;
+		outq_dropped_bytes += len;
+		return;
+	}
+
+	if (!CIRC_AVAIL(&outq)) {
+		do {
+			n = writev(STDOUT_FILENO, p, count);
+		} while (n < 0 && errno == EINTR);
+
+		if (n < 0 && errno == EAGAIN)
+			n = 0;
+		else if (n < 0)
+			return;
+
+		total -= n;
+		if (!total)
+			return;
+
+		while (n >= p->iov_len) {
+			n -= p->iov_len;
+			p++;
+			count--;
+		}
+
+		p->iov_base += n;
+		p->iov_len -= n;
+	}
+
+	/* Control messages are never dropped, wait for the client if need be */
+	if (CIRC_SPACE(&outq) < total)
+		outq_wait(total, -1);
+
+	if (CIRC_SPACE(&outq) < total)
+		errx(1, "message too large for output queue");
+
+	for (i = 0; i < count; i++)
+		circ_write(&outq, p[i].iov_base, p[i].iov_len);
+
+	watch_add_writefd(STDOUT_FILENO, outq_flush, NULL);
+}
+
+void cdba_send(int type, const void *data, size_t len)
+{
+	struct iovec iov = { (void *)data, len };
+
+	cdba_sendv(type, &iov, 1);
+}
+
 static void fastboot_opened(struct fastboot *fb, void *data)
 {
 	const uint8_t one = 1;
-	struct msg *msg;
 
 	warnx("fastboot connection opened");
 
-	msg = alloca(sizeof(*msg) + 1);
-	msg->type = MSG_FASTBOOT_PRESENT;
-	msg->len = 1;
-	memcpy(msg->data, &one, 1);
+	fastboot_present = true;
+
+	cdba_send(MSG_FASTBOOT_PRESENT, &one, 1);
 
-	write(STDOUT_FILENO, msg, sizeof(*msg) + 1);
+	/* The device may still be opening the fastboot interface, boot after */
+	watch_timer_add(0, fastboot_boot_deferred, NULL);
 }
 
 static void fastboot_info(struct fastboot *fb, const void *buf, size_t len)
@@ -101,14 +317,10 @@ static void fastboot_info(struct fastboot *fb, const void *buf, size_t len)
 static void fastboot_disconnect(void *data)
 {
 	const uint8_t zero = 0;
-	struct msg *msg;
 
-	msg = alloca(sizeof(*msg) + 1);
-	msg->type = MSG_FASTBOOT_PRESENT;
-	msg->len = 1;
-	memcpy(msg->data, &zero, 1);
+	fastboot_present = false;
 
-	write(STDOUT_FILENO, msg, sizeof(*msg) + 1);
+	cdba_send(MSG_FASTBOOT_PRESENT, &zero, 1);
 }
 
 static struct fastboot_ops fastboot_ops = {
@@ -117,9 +329,14 @@ static struct fastboot_ops fastboot_ops = {
 	.info = fastboot_info,
 };
 
-static void msg_select_board(const void *param)
+static void msg_select_board(const void *param, size_t len)
 {
-	struct msg reply = { MSG_SELECT_BOARD, 0 };
+	struct msg_hello hello = { 0 };
+	size_t blen = strnlen(param, len);
+
+	/* Version 2 clients append their hello after the board name */
+	if (len >= blen + 1 + sizeof(hello))
+		memcpy(&hello, param + blen + 1, sizeof(hello));
 
 	selected_device = device_open(param, &fastboot_ops);
 	if (!selected_device) {
@@ -127,77 +344,562 @@ static void msg_select_board(const void *param)
 		quit_invoked = true;
 	}
 
-	write(STDOUT_FILENO, &reply, sizeof(reply));
+	if (hello.version < CDBA_PROTOCOL_V2) {
+		cdba_send(MSG_SELECT_BOARD, NULL, 0);
+		return;
+	}
+
+	len = le32toh(hello.len_max);
+
+	hello.version = CDBA_PROTOCOL_V2;
+	hello.len_max = htole32(MSG_V2_LEN_MAX);
+	cdba_send(MSG_SELECT_BOARD, &hello, sizeof(hello));
+
+	/* Everything following the reply uses the new framing */
+	msg_set_version(CDBA_PROTOCOL_V2, len);
+}
+
+static struct image *fastboot_image;
+static bool fastboot_booting;
+static bool fastboot_deferred;
+
+/* Last booted image, retained for MSG_FASTBOOT_BOOT during the session */
+static struct image *fastboot_retained;
+
+static uint8_t fastboot_digest[SHA256_DIGEST_SIZE];
+static struct sha256 fastboot_sha;
+static bool fastboot_caching;
+
+static struct image *fastboot_base;
+static size_t fastboot_base_block;
+static size_t fastboot_delta_size;
+
+/* Upload bytes a version 2 client may have in flight towards the server */
+#define FASTBOOT_CREDIT_WINDOW	(1024 * 1024)
+
+/*
+ * Staged image bytes allowed ahead of the download to the device while the
+ * boot worker reads the image. Before the board gets to fastboot the upload
+ * is only bounded by the announced image size.
+ */
+#define FASTBOOT_STAGE_AHEAD	(64 * 1024 * 1024)
+
+static size_t fastboot_credit_used;
+static size_t fastboot_drained;
+
+static void fastboot_credit_grant(size_t credit)
+{
+	uint32_t grant = htole32(credit);
+
+	if (msg_version() < CDBA_PROTOCOL_V2)
+		return;
+
+	cdba_send(MSG_FASTBOOT_CREDIT, &grant, sizeof(grant));
+}
+
+/*
+ * Return credit to the client for the upload bytes received. While the image
+ * is being booted, credit is held back until the staged image is no further
+ * than FASTBOOT_STAGE_AHEAD ahead of what has been handed to the device.
+ * Grants are batched to a quarter of the window to keep their number down.
+ */
+static void fastboot_credit_update(void)
+{
+	if (fastboot_credit_used < FASTBOOT_CREDIT_WINDOW / 4)
+		return;
+
+	if (fastboot_booting && fastboot_image->len > fastboot_drained &&
+	    fastboot_image->len - fastboot_drained > FASTBOOT_STAGE_AHEAD)
+		return;
+
+	fastboot_credit_grant(fastboot_credit_used);
+	fastboot_credit_used = 0;
+}
+
+static void fastboot_credit_return(size_t len)
+{
+	fastboot_credit_used += len;
+	fastboot_credit_update();
+}
+
+static void msg_fastboot_boot(void);
+
+/* MSG_FASTBOOT_BOOT received while the previous image was still in use */
+static bool fastboot_boot_pending;
+
+static void fastboot_boot_complete(void)
+{
+	cdba_send(MSG_FASTBOOT_DOWNLOAD, NULL, 0);
+
+	/* A rejected upload isn't worth booting again */
+	if (image_failed(fastboot_image)) {
+		if (fastboot_image != fastboot_retained)
+			image_free(fastboot_image);
+	} else {
+		if (fastboot_retained != fastboot_image)
+			image_free(fastboot_retained);
+		fastboot_retained = fastboot_image;
+	}
+
+	fastboot_image = NULL;
+
+	if (fastboot_boot_pending) {
+		fastboot_boot_pending = false;
+		msg_fastboot_boot();
+	}
+}
+
+static void fastboot_boot_progress(struct device *device, size_t offset)
+{
+	fastboot_drained = offset;
+	fastboot_credit_update();
+}
+
+static void fastboot_boot_done(struct device *device, int ret)
+{
+	fastboot_booting = false;
+
+	/* Nothing more is drained, let the rest of the upload through */
+	fastboot_drained = SIZE_MAX;
+	fastboot_credit_update();
+
+	/* Hold on to the image until the client has sent all of it */
+	if (fastboot_image->complete)
+		fastboot_boot_complete();
+}
+
+static void fastboot_boot_image(void)
+{
+	int ret;
+
+	/* Keep staging the image until the board enters fastboot */
+	if (!fastboot_present) {
+		fastboot_deferred = true;
+		return;
+	}
+
+	fastboot_deferred = false;
+
+	ret = device_boot(selected_device, fastboot_image, fastboot_boot_progress,
+			  fastboot_boot_done);
+	if (ret < 0) {
+		fprintf(stderr, "failed to boot image: %s\n", strerror(-ret));
+		fastboot_drained = SIZE_MAX;
+		fastboot_credit_update();
+		return;
+	}
+
+	fastboot_drained = 0;
+	fastboot_booting = true;
+}
+
+/* Boot the image staged while the board was still powering up */
+static void fastboot_boot_deferred(void *data)
+{
+	if (!fastboot_deferred)
+		return;
+
+	fastboot_boot_image();
+	if (!fastboot_booting && fastboot_image->complete)
+		fastboot_boot_complete();
+}
+
+/* Find the image previously booted on this board, to use as delta base */
+static bool fastboot_delta_prepare(uint32_t size)
+{
+	fastboot_base = cache_lookup_last(selected_device->board);
+	if (!fastboot_base)
+		return false;
+
+	fastboot_base_block = delta_block_size(size);
+	fastboot_delta_size = size;
+
+	if (fastboot_base->size < fastboot_base_block) {
+		image_free(fastboot_base);
+		fastboot_base = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+/* Base image bytes to compute signatures for per main loop iteration */
+#define FASTBOOT_SIGNATURE_STEP	(4 * 1024 * 1024)
+
+static struct delta_sig *fastboot_sigs;
+static size_t fastboot_sig_count;
+static size_t fastboot_sig_done;
+static size_t fastboot_sig_sent;
+
+/*
+ * Compute the next batch of block signatures and send what's complete. The
+ * base image may be several GB, so the work is spread over main loop
+ * iterations to keep the console and other traffic flowing.
+ */
+static void fastboot_signature_step(void *data)
+{
+	size_t block = fastboot_base_block;
+	size_t chunk = msg_bulk_len() / sizeof(struct delta_sig);
+	size_t i;
+	size_t n;
+
+	/* The delta was concluded, or abandoned, before all were sent */
+	if (!fastboot_base) {
+		free(fastboot_sigs);
+		fastboot_sigs = NULL;
+		return;
+	}
+
+	n = MAX(FASTBOOT_SIGNATURE_STEP / block, 1);
+	n = MIN(n, fastboot_sig_count - fastboot_sig_done);
+
+	delta_signature(fastboot_base->ptr + fastboot_sig_done * block, n, block,
+			&fastboot_sigs[fastboot_sig_done]);
+	for (i = fastboot_sig_done; i < fastboot_sig_done + n; i++)
+		fastboot_sigs[i].weak = htole32(fastboot_sigs[i].weak);
+	fastboot_sig_done += n;
+
+	while (fastboot_sig_sent < fastboot_sig_done &&
+	       (fastboot_sig_done - fastboot_sig_sent >= chunk ||
+		fastboot_sig_done == fastboot_sig_count)) {
+		n = MIN(fastboot_sig_done - fastboot_sig_sent, chunk);
+
+		cdba_send(MSG_FASTBOOT_DELTA_SIGNATURE, &fastboot_sigs[fastboot_sig_sent],
+			  n * sizeof(*fastboot_sigs));
+		fastboot_sig_sent += n;
+	}
+
+	if (fastboot_sig_done < fastboot_sig_count) {
+		watch_timer_add(0, fastboot_signature_step, NULL);
+		return;
+	}
+
+	cdba_send(MSG_FASTBOOT_DELTA_SIGNATURE, NULL, 0);
+
+	free(fastboot_sigs);
+	fastboot_sigs = NULL;
+}
+
+/*
+ * Send the block signatures of the base image, so that the client can
+ * describe the new image as a delta against it.
+ */
+static void fastboot_send_signature(void)
+{
+	struct delta_sig_hdr hdr;
+
+	free(fastboot_sigs);
+
+	fastboot_sig_count = fastboot_base->size / fastboot_base_block;
+	fastboot_sig_done = 0;
+	fastboot_sig_sent = 0;
+
+	fastboot_sigs = malloc(fastboot_sig_count * sizeof(*fastboot_sigs));
+	if (!fastboot_sigs)
+		err(1, "failed to allocate delta signatures");
+
+	hdr.block_size = htole32(fastboot_base_block);
+	hdr.count = htole32(fastboot_sig_count);
+	cdba_send(MSG_FASTBOOT_DELTA_SIGNATURE, &hdr, sizeof(hdr));
+
+	watch_timer_add(0, fastboot_signature_step, NULL);
+}
+
+static void msg_fastboot_digest(const void *data, size_t len)
+{
+	struct image *image;
+	uint32_t size;
+	uint8_t result = FASTBOOT_DIGEST_MISS;
+
+	if (len != sizeof(size) + SHA256_DIGEST_SIZE) {
+		fprintf(stderr, "malformed fastboot digest\n");
+		return;
+	}
+
+	memcpy(&size, data, sizeof(size));
+	size = le32toh(size);
+	memcpy(fastboot_digest, data + sizeof(size), SHA256_DIGEST_SIZE);
+
+	if (!fastboot_image) {
+		image = cache_lookup(fastboot_digest);
+		if (image && image->size == size) {
+			fastboot_image = image;
+			result = FASTBOOT_DIGEST_HIT;
+		} else {
+			image_free(image);
+		}
+	}
+
+	fastboot_caching = result != FASTBOOT_DIGEST_HIT;
+
+	/* Signatures follow the reply, if there's an image to compare against */
+	if (fastboot_caching && !fastboot_image && !fastboot_base &&
+	    fastboot_delta_prepare(size))
+		result = FASTBOOT_DIGEST_DELTA;
+
+	cdba_send(MSG_FASTBOOT_DIGEST, &result, 1);
+
+	switch (result) {
+	case FASTBOOT_DIGEST_HIT:
+		cache_set_last(selected_device->board, fastboot_digest);
+
+		/* The cached image is complete, boot it right away */
+		fastboot_boot_image();
+		if (!fastboot_booting && !fastboot_deferred)
+			fastboot_boot_complete();
+		break;
+	case FASTBOOT_DIGEST_DELTA:
+		fastboot_send_signature();
+		break;
+	}
+
+	/* Open the window for the upload, or the delta, to follow */
+	if (result != FASTBOOT_DIGEST_HIT) {
+		fastboot_credit_used = 0;
+		fastboot_drained = 0;
+		fastboot_credit_grant(FASTBOOT_CREDIT_WINDOW);
+	}
+}
+
+/* Set while an upload that couldn't be given a staging area is discarded */
+static bool fastboot_rejected;
+
+static void fastboot_stage_begin(size_t size)
+{
+	/* Without room in the cache the image can still be booted */
+	if (fastboot_caching) {
+		fastboot_image = cache_alloc(size);
+		sha256_init(&fastboot_sha);
+		fastboot_caching = fastboot_image != NULL;
+	}
+
+	if (!fastboot_image)
+		fastboot_image = image_alloc(size, NULL);
+
+	if (!fastboot_image) {
+		fprintf(stderr, "failed to stage fastboot image: %s, rejecting download\n",
+			strerror(errno));
+		fastboot_rejected = true;
+		return;
+	}
+
+	/* Start streaming the image to the device as it arrives */
+	fastboot_boot_image();
+}
+
+/*
+ * Reject the upload if it can't be staged; the rest of it is discarded as it
+ * arrives and the session carries on without booting it.
+ */
+static void fastboot_stage(const void *data, size_t len)
+{
+	int ret;
+
+	if (fastboot_rejected || image_failed(fastboot_image))
+		return;
+
+	ret = image_append(fastboot_image, data, len);
+	if (ret < 0) {
+		fprintf(stderr, "failed to stage fastboot image: %s, rejecting download\n",
+			strerror(-ret));
+		image_abort(fastboot_image);
+		fastboot_caching = false;
+		fastboot_deferred = false;
+		return;
+	}
+
+	if (fastboot_caching)
+		sha256_update(&fastboot_sha, data, len);
+}
+
+static void fastboot_cache_image(void)
+{
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	int ret;
+
+	fastboot_caching = false;
+
+	sha256_final(&fastboot_sha, digest);
+	if (memcmp(digest, fastboot_digest, sizeof(digest))) {
+		fprintf(stderr, "fastboot image digest mismatch, not caching\n");
+		return;
+	}
+
+	ret = cache_store(fastboot_image, digest);
+	if (ret < 0) {
+		fprintf(stderr, "failed to cache fastboot image: %s\n", strerror(-ret));
+		return;
+	}
+
+	cache_set_last(selected_device->board, digest);
+}
+
+static void fastboot_stage_end(void)
+{
+	if (fastboot_rejected) {
+		fastboot_rejected = false;
+		cdba_send(MSG_FASTBOOT_DOWNLOAD, NULL, 0);
+		return;
+	}
+
+	image_commit(fastboot_image);
+
+	if (fastboot_caching)
+		fastboot_cache_image();
+
+	if (!fastboot_image->size && !image_failed(fastboot_image))
+		fastboot_boot_image();
+
+	if (!fastboot_booting && !fastboot_deferred)
+		fastboot_boot_complete();
 }
 
-static void *fastboot_payload;
-static size_t fastboot_size;
+static void msg_fastboot_download_size(const void *data, size_t len)
+{
+	uint32_t size;
+
+	if (len != sizeof(size)) {
+		fprintf(stderr, "malformed fastboot download size\n");
+		return;
+	}
+
+	if (fastboot_image || fastboot_rejected) {
+		fprintf(stderr, "fastboot download already in progress\n");
+		return;
+	}
+
+	memcpy(&size, data, sizeof(size));
+
+	fastboot_stage_begin(le32toh(size));
+}
 
 static void msg_fastboot_download(const void *data, size_t len)
 {
-	struct msg reply = { MSG_FASTBOOT_DOWNLOAD, };
-	size_t new_size = fastboot_size + len;
-	void *newp;
+	/* Version 1 clients don't announce the size, the image boots once complete */
+	if (!fastboot_image && !fastboot_rejected) {
+		fastboot_image = image_alloc(0, NULL);
+		fastboot_caching = false;
+
+		if (!fastboot_image) {
+			fprintf(stderr, "failed to stage fastboot image: %s, rejecting download\n",
+				strerror(errno));
+			fastboot_rejected = true;
+		}
+	}
 
-	newp = realloc(fastboot_payload, new_size);
-	if (!newp)
-		err(1, "failed too expant fastboot scratch area");
+	if (len) {
+		fastboot_stage(data, len);
+		fastboot_credit_return(len);
+	} else {
+		fastboot_stage_end();
+	}
+}
 
-	memcpy(newp + fastboot_size, data, len);
+static void msg_fastboot_delta(const void *data, size_t len)
+{
+	struct delta_copy copy;
+	size_t blocks;
+	const uint8_t *op = data;
 
-	fastboot_payload = newp;
-	fastboot_size = new_size;
+	if (!fastboot_base) {
+		fprintf(stderr, "fastboot delta without base image\n");
+		return;
+	}
+
+	if (!fastboot_image && !fastboot_rejected)
+		fastboot_stage_begin(fastboot_delta_size);
 
 	if (!len) {
-		device_boot(selected_device, fastboot_payload, fastboot_size);
+		image_free(fastboot_base);
+		fastboot_base = NULL;
+
+		fastboot_stage_end();
+		return;
+	}
 
-		write(STDOUT_FILENO, &reply, sizeof(reply));
-		free(fastboot_payload);
-		fastboot_payload = NULL;
-		fastboot_size = 0;
+	switch (*op) {
+	case DELTA_OP_COPY:
+		if (len != sizeof(copy))
+			errx(1, "malformed fastboot delta copy");
+
+		memcpy(&copy, data, sizeof(copy));
+		copy.block = le32toh(copy.block);
+		copy.count = le32toh(copy.count);
+
+		blocks = fastboot_base->size / fastboot_base_block;
+		if (copy.block >= blocks || copy.count > blocks - copy.block)
+			errx(1, "fastboot delta copy out of range");
+
+		fastboot_stage(fastboot_base->ptr + copy.block * fastboot_base_block,
+			       copy.count * fastboot_base_block);
+		break;
+	case DELTA_OP_LITERAL:
+		fastboot_stage(op + 1, len - 1);
+		break;
+	default:
+		errx(1, "unknown fastboot delta op %d", *op);
 	}
+
+	fastboot_credit_return(len);
 }
 
-static void invoke_reply(int reply)
+/* Boot the image of the previous download again, without a new upload */
+static void msg_fastboot_boot(void)
 {
-	struct msg msg = { reply, };
+	uint8_t retained = fastboot_retained != NULL;
+
+	/*
+	 * Answer once the image being uploaded or booted is done with, it's
+	 * the one to retain, rather than have the client upload it again.
+	 */
+	if (fastboot_image) {
+		fastboot_boot_pending = true;
+		return;
+	}
+
+	cdba_send(MSG_FASTBOOT_BOOT, &retained, 1);
+
+	if (!retained)
+		return;
+
+	fastboot_image = fastboot_retained;
+	fastboot_caching = false;
 
-	write(STDOUT_FILENO, &msg, sizeof(msg));
+	fastboot_boot_image();
+	if (!fastboot_booting && !fastboot_deferred)
+		fastboot_boot_complete();
+}
+
+static void invoke_reply(int reply)
+{
+	cdba_send(reply, NULL, 0);
 }
 
 static int handle_stdin(int fd, void *buf)
 {
-	static struct circ_buf recv_buf = { 0 };
-	struct msg *msg;
-	struct msg hdr;
-	size_t n;
+	struct circ_buf *recv_buf = buf;
+	struct msg_hdr hdr;
+	const void *data;
 	int ret;
 
-	ret = circ_fill(STDIN_FILENO, &recv_buf);
+	ret = circ_fill(STDIN_FILENO, recv_buf);
 	if (ret < 0 && errno != EAGAIN) {
 		fprintf(stderr, "read %d\n", ret);
 		return -1;
 	}
 
 	for (;;) {
-		n = circ_peak(&recv_buf, &hdr, sizeof(hdr));
-		if (n != sizeof(hdr))
-			return 0;
-
-		if (CIRC_AVAIL(&recv_buf) < sizeof(*msg) + hdr.len)
+		if (!msg_frame_next(recv_buf, &hdr, &data))
 			return 0;
 
-		msg = malloc(sizeof(*msg) + hdr.len);
-		circ_read(&recv_buf, msg, sizeof(*msg) + hdr.len);
-
-		switch (msg->type) {
+		switch (hdr.type) {
 		case MSG_CONSOLE:
-			device_write(selected_device, msg->data, msg->len);
+			device_write(selected_device, data, hdr.len);
 			break;
 		case MSG_FASTBOOT_PRESENT:
 			break;
 		case MSG_SELECT_BOARD:
-			msg_select_board(msg->data);
+			msg_select_board(data, hdr.len);
 			break;
 		case MSG_HARDRESET:
 			// fprintf(stderr, "hard reset\n");
@@ -213,10 +915,19 @@ static int handle_stdin(int fd, void *buf)
 			invoke_reply(MSG_POWER_OFF);
 			break;
 		case MSG_FASTBOOT_DOWNLOAD:
-			msg_fastboot_download(msg->data, msg->len);
+			msg_fastboot_download(data, hdr.len);
+			break;
+		case MSG_FASTBOOT_DOWNLOAD_SIZE:
+			msg_fastboot_download_size(data, hdr.len);
+			break;
+		case MSG_FASTBOOT_DIGEST:
+			msg_fastboot_digest(data, hdr.len);
+			break;
+		case MSG_FASTBOOT_DELTA:
+			msg_fastboot_delta(data, hdr.len);
 			break;
 		case MSG_FASTBOOT_BOOT:
-			// fprintf(stderr, "fastboot boot\n");
+			msg_fastboot_boot();
 			break;
 		case MSG_STATUS_UPDATE:
 			device_print_status(selected_device);
@@ -234,14 +945,12 @@ static int handle_stdin(int fd, void *buf)
 			device_list_devices();
 			break;
 		case MSG_BOARD_INFO:
-			device_info(msg->data, msg->len);
+			device_info(data, hdr.len);
 			break;
 		default:
-			fprintf(stderr, "unk %d len %d\n", msg->type, msg->len);
+			fprintf(stderr, "unk %d len %zu\n", hdr.type, hdr.len);
 			exit(1);
 		}
-
-		free(msg);
 	}
 
 	return 0;
@@ -251,98 +960,417 @@ struct watch {
 	struct list_head node;
 
 	int fd;
-	int (*cb)(int, void*);
-	void *data;
+	int (*read_cb)(int, void*);
+	void *read_data;
+	int (*write_cb)(int, void*);
+	void *write_data;
+
+	bool always_ready;
 };
 
 struct timer {
-	struct list_head node;
-	struct timeval tv;
+	struct timespec expires;
+	unsigned long seq;
+	size_t index;
 
 	void (*cb)(void *);
 	void *data;
 };
 
-static struct list_head read_watches = LIST_INIT(read_watches);
-static struct list_head timer_watches = LIST_INIT(timer_watches);
+#define WATCH_EVENTS_MAX	16
 
-void watch_add_readfd(int fd, int (*cb)(int, void*), void *data)
+static struct list_head watches = LIST_INIT(watches);
+static struct list_head dead_watches = LIST_INIT(dead_watches);
+
+/* Pending timers, as a binary min-heap ordered by expiry */
+static struct timer **timer_heap;
+static size_t timer_count;
+static size_t timer_alloc;
+static unsigned long timer_seq;
+
+static int timer_fd = -1;
+
+static int watch_epoll_fd = -1;
+
+/* Watches on fds that epoll refuses, e.g. regular files or /dev/null */
+static unsigned int watch_always_ready;
+
+static struct watch *watch_find(int fd)
+{
+	struct watch *w;
+
+	list_for_each_entry(w, &watches, node) {
+		if (w->fd == fd)
+			return w;
+	}
+
+	return NULL;
+}
+
+/*
+ * Register, update or drop the epoll interest for @w, based on which of its
+ * callbacks are set. Dropped watches are released after the current round of
+ * events has been dispatched, as they might still be referenced by it.
+ *
+ * Files that don't support polling are always ready for I/O, so watches on
+ * those are kept out of epoll and dispatched on every loop iteration.
+ */
+static void watch_update(struct watch *w, bool added)
+{
+	struct epoll_event ev = {};
+	int ret;
+
+	if (w->read_cb)
+		ev.events |= EPOLLIN;
+	if (w->write_cb)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = w;
+
+	if (!ev.events) {
+		if (w->always_ready)
+			watch_always_ready--;
+		else
+			epoll_ctl(watch_epoll_fd, EPOLL_CTL_DEL, w->fd, NULL);
+
+		list_del(&w->node);
+		list_add(&dead_watches, &w->node);
+		return;
+	}
+
+	if (w->always_ready)
+		return;
+
+	ret = epoll_ctl(watch_epoll_fd, added ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, w->fd, &ev);
+	/* The fd might have been closed, and reused, without removing the watch */
+	if (ret < 0 && errno == ENOENT)
+		ret = epoll_ctl(watch_epoll_fd, EPOLL_CTL_ADD, w->fd, &ev);
+	if (ret < 0 && errno == EPERM) {
+		w->always_ready = true;
+		watch_always_ready++;
+		return;
+	}
+	if (ret < 0)
+		err(1, "failed to watch fd %d", w->fd);
+}
+
+static struct watch *watch_get(int fd, bool *added)
 {
 	struct watch *w;
 
+	if (watch_epoll_fd < 0) {
+		watch_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (watch_epoll_fd < 0)
+			err(1, "failed to create epoll instance");
+	}
+
+	w = watch_find(fd);
+	if (w) {
+		*added = false;
+		return w;
+	}
+
 	w = calloc(1, sizeof(*w));
 	w->fd = fd;
-	w->cb = cb;
-	w->data = data;
 
-	list_add(&read_watches, &w->node);
+	list_add(&watches, &w->node);
+
+	*added = true;
+	return w;
 }
 
-void watch_timer_add(int timeout_ms, void (*cb)(void *), void *data)
+void watch_add_readfd(int fd, int (*cb)(int, void*), void *data)
 {
-	struct timeval tv_timeout;
-	struct timeval now;
-	struct timer *t;
+	struct watch *w;
+	bool added;
 
-	t = calloc(1, sizeof(*t));
+	w = watch_get(fd, &added);
+	w->read_cb = cb;
+	w->read_data = data;
 
-	gettimeofday(&now, NULL);
+	watch_update(w, added);
+}
 
-	tv_timeout.tv_sec = timeout_ms / 1000;
-	tv_timeout.tv_usec = (timeout_ms % 1000) * 1000;
+/**
+ * watch_add_writefd() - invoke @cb whenever @fd is writable
+ * @fd:		file descriptor to watch
+ * @cb:		callback, a negative return value terminates the server
+ * @data:	context passed to @cb
+ *
+ * The watch stays in place until removed with watch_del_writefd(), which
+ * typically is done by @cb once it has no more data to write.
+ */
+void watch_add_writefd(int fd, int (*cb)(int, void*), void *data)
+{
+	struct watch *w;
+	bool added;
 
-	t->cb = cb;
-	t->data = data;
-	timeradd(&now, &tv_timeout, &t->tv);
+	w = watch_get(fd, &added);
+	w->write_cb = cb;
+	w->write_data = data;
 
-	list_add(&timer_watches, &t->node);
+	watch_update(w, added);
 }
 
-static struct timeval *watch_timer_next(void)
+void watch_del_readfd(int fd)
 {
-	static struct timeval timeout;
-	struct timeval now;
-	struct timer *next;
-	struct timer *t;
+	struct watch *w;
+
+	w = watch_find(fd);
+	if (!w || !w->read_cb)
+		return;
+
+	w->read_cb = NULL;
+	watch_update(w, false);
+}
+
+void watch_del_writefd(int fd)
+{
+	struct watch *w;
+
+	w = watch_find(fd);
+	if (!w || !w->write_cb)
+		return;
+
+	w->write_cb = NULL;
+	watch_update(w, false);
+}
+
+static int watch_dispatch(struct watch *w, uint32_t events)
+{
+	int ret;
+
+	if (w->read_cb && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+		ret = w->read_cb(w->fd, w->read_data);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (w->write_cb && (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+		ret = w->write_cb(w->fd, w->write_data);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Dispatch the watches that epoll can't report readiness for. The callbacks
+ * might add or drop watches, so the ready ones are collected first; dropped
+ * ones have no callbacks left and are skipped by watch_dispatch().
+ */
+static int watch_dispatch_always_ready(void)
+{
+	struct watch *ready[WATCH_EVENTS_MAX];
+	struct watch *w;
 	int count = 0;
+	int ret;
+	int i;
+
+	list_for_each_entry(w, &watches, node) {
+		if (w->always_ready && count < WATCH_EVENTS_MAX)
+			ready[count++] = w;
+	}
 
-	if (list_empty(&timer_watches))
-		return NULL;
+	for (i = 0; i < count; i++) {
+		ret = watch_dispatch(ready[i], EPOLLIN | EPOLLOUT);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
 
-	next = list_entry_first(&timer_watches, struct timer, node);
+static void watch_reap(void)
+{
+	struct watch *tmp;
+	struct watch *w;
 
-	list_for_each_entry(t, &timer_watches, node) {
-		if (timercmp(&t->tv, &next->tv, <))
-			next = t;
-		count++;
+	list_for_each_entry_safe(w, tmp, &dead_watches, node) {
+		list_del(&w->node);
+		free(w);
 	}
+}
+
+static bool timer_before(const struct timer *a, const struct timer *b)
+{
+	if (a->expires.tv_sec != b->expires.tv_sec)
+		return a->expires.tv_sec < b->expires.tv_sec;
+	if (a->expires.tv_nsec != b->expires.tv_nsec)
+		return a->expires.tv_nsec < b->expires.tv_nsec;
+
+	/* Timers with equal expiry fire in the order they were added */
+	return a->seq < b->seq;
+}
 
-	gettimeofday(&now, NULL);
-	timersub(&next->tv, &now, &timeout);
-	if (timeout.tv_sec < 0) {
-		timeout.tv_sec = 0;
-		timeout.tv_usec = 0;
+static void timer_heap_set(size_t index, struct timer *t)
+{
+	timer_heap[index] = t;
+	t->index = index;
+}
+
+static void timer_heap_up(size_t index)
+{
+	struct timer *t = timer_heap[index];
+	size_t parent;
+
+	while (index) {
+		parent = (index - 1) / 2;
+		if (!timer_before(t, timer_heap[parent]))
+			break;
+
+		timer_heap_set(index, timer_heap[parent]);
+		index = parent;
 	}
 
-	return &timeout;
+	timer_heap_set(index, t);
 }
 
-static void watch_timer_invoke(void)
+static void timer_heap_down(size_t index)
 {
-	struct timeval now;
-	struct timer *tmp;
+	struct timer *t = timer_heap[index];
+	size_t child;
+
+	for (;;) {
+		child = 2 * index + 1;
+		if (child >= timer_count)
+			break;
+
+		if (child + 1 < timer_count &&
+		    timer_before(timer_heap[child + 1], timer_heap[child]))
+			child++;
+
+		if (!timer_before(timer_heap[child], t))
+			break;
+
+		timer_heap_set(index, timer_heap[child]);
+		index = child;
+	}
+
+	timer_heap_set(index, t);
+}
+
+static void timer_heap_remove(struct timer *t)
+{
+	size_t index = t->index;
+	struct timer *last;
+
+	last = timer_heap[--timer_count];
+	if (last == t)
+		return;
+
+	timer_heap_set(index, last);
+	timer_heap_up(index);
+	timer_heap_down(last->index);
+}
+
+/* Program the timerfd for the earliest pending timer, or disarm it */
+static void timer_arm(void)
+{
+	struct itimerspec its = {};
+
+	if (timer_count)
+		its.it_value = timer_heap[0]->expires;
+
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		err(1, "failed to arm timer");
+}
+
+static int timer_expired(int fd, void *data)
+{
+	struct timespec now;
+	uint64_t ticks;
 	struct timer *t;
 
-	gettimeofday(&now, NULL);
+	read(fd, &ticks, sizeof(ticks));
 
-	list_for_each_entry_safe(t, tmp, &timer_watches, node) {
-		if (timercmp(&t->tv, &now, <)) {
-			t->cb(t->data);
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-			list_del(&t->node);
-			free(t);
-		}
+	while (timer_count) {
+		t = timer_heap[0];
+		if (t->expires.tv_sec > now.tv_sec ||
+		    (t->expires.tv_sec == now.tv_sec && t->expires.tv_nsec > now.tv_nsec))
+			break;
+
+		timer_heap_remove(t);
+
+		t->cb(t->data);
+		free(t);
 	}
+
+	timer_arm();
+
+	return 0;
+}
+
+/**
+ * watch_timer_add() - invoke @cb once, after @timeout_ms milliseconds
+ * @timeout_ms:	delay, relative to CLOCK_MONOTONIC
+ * @cb:		callback
+ * @data:	context passed to @cb
+ *
+ * Return: handle for watch_timer_cancel(), valid until @cb has been invoked
+ */
+struct timer *watch_timer_add(int timeout_ms, void (*cb)(void *), void *data)
+{
+	struct timer *t;
+
+	if (timer_fd < 0) {
+		timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (timer_fd < 0)
+			err(1, "failed to create timerfd");
+
+		watch_add_readfd(timer_fd, timer_expired, NULL);
+	}
+
+	if (timer_count == timer_alloc) {
+		timer_alloc = timer_alloc ? 2 * timer_alloc : 16;
+		timer_heap = realloc(timer_heap, timer_alloc * sizeof(*timer_heap));
+		if (!timer_heap)
+			err(1, "failed to allocate timer heap");
+	}
+
+	t = calloc(1, sizeof(*t));
+
+	clock_gettime(CLOCK_MONOTONIC, &t->expires);
+	t->expires.tv_sec += timeout_ms / 1000;
+	t->expires.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (t->expires.tv_nsec >= 1000000000L) {
+		t->expires.tv_sec++;
+		t->expires.tv_nsec -= 1000000000L;
+	}
+
+	t->seq = timer_seq++;
+	t->cb = cb;
+	t->data = data;
+
+	timer_heap_set(timer_count++, t);
+	timer_heap_up(t->index);
+
+	if (timer_heap[0] == t)
+		timer_arm();
+
+	return t;
+}
+
+/**
+ * watch_timer_cancel() - cancel a pending timer
+ * @t:		handle returned by watch_timer_add(), or NULL
+ */
+void watch_timer_cancel(struct timer *t)
+{
+	bool first;
+
+	if (!t)
+		return;
+
+	first = timer_heap[0] == t;
+
+	timer_heap_remove(t);
+	free(t);
+
+	if (first)
+		timer_arm();
 }
 
 static void sigpipe_handler(int signo)
@@ -355,62 +1383,89 @@ void watch_quit(void)
 	quit_invoked = true;
 }
 
+static void usage(void)
+{
+	extern const char *__progname;
+
+	fprintf(stderr, "usage: %s [-d]\n", __progname);
+	exit(1);
+}
+
 int main(int argc, char **argv)
 {
-	struct timeval *timeoutp;
-	struct watch *w;
-	fd_set rfds;
+	struct epoll_event events[WATCH_EVENTS_MAX];
+	struct circ_buf recv_buf;
 	int flags;
-	int nfds;
 	int ret;
+	bool daemonize = false;
+	int opt;
+	int i;
+	int n;
+
+	while ((opt = getopt(argc, argv, "d")) != -1) {
+		switch (opt) {
+		case 'd':
+			daemonize = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	/* Let a running daemon serve the session, if there is one */
+	if (!daemonize)
+		daemon_relay(daemon_socket_path());
 
 	signal(SIGPIPE, sigpipe_handler);
 
-	ret = device_parser(".cdba");
-	if (ret) {
-		ret = device_parser("/etc/cdba");
-		if (ret) {
-			fprintf(stderr, "device parser: unable to open config file\n");
-			exit(1);
-		}
+	if (device_parser_default() < 0) {
+		fprintf(stderr, "device parser: unable to open config file\n");
+		exit(1);
 	}
 
-	watch_add_readfd(STDIN_FILENO, handle_stdin, NULL);
+	/* Returns in the process serving a session */
+	if (daemonize)
+		daemon_run(daemon_socket_path());
 
-	flags = fcntl(STDIN_FILENO, F_GETFL, 0);
-	fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
+	ret = circ_init(&recv_buf, CIRC_BUF_SIZE, true);
+	if (ret < 0)
+		errx(1, "failed to allocate receive buffer");
 
-	while (!quit_invoked) {
-		nfds = 0;
+	ret = circ_init(&outq, CDBA_OUTQ_SIZE, true);
+	if (ret < 0)
+		errx(1, "failed to allocate output queue");
 
-		list_for_each_entry(w, &read_watches, node) {
-			nfds = MAX(nfds, w->fd);
-			FD_SET(w->fd, &rfds);
-		}
+	watch_add_readfd(STDIN_FILENO, handle_stdin, &recv_buf);
 
-		if (!FD_ISSET(STDIN_FILENO, &rfds)) {
-			fprintf(stderr, "rfds is trash!\n");
-			goto done;
-		}
+	flags = fcntl(STDIN_FILENO, F_GETFL, 0);
+	fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
+
+	flags = fcntl(STDOUT_FILENO, F_GETFL, 0);
+	fcntl(STDOUT_FILENO, F_SETFL, flags | O_NONBLOCK);
 
-		timeoutp = watch_timer_next();
-		ret = select(nfds + 1, &rfds, NULL, NULL, timeoutp);
+	while (!quit_invoked) {
+		ret = epoll_wait(watch_epoll_fd, events, WATCH_EVENTS_MAX,
+				 watch_always_ready ? 0 : -1);
 		if (ret < 0 && errno == EINTR)
 			continue;
 		else if (ret < 0)
 			break;
 
-		watch_timer_invoke();
-
-		list_for_each_entry(w, &read_watches, node) {
-			if (FD_ISSET(w->fd, &rfds)) {
-				ret = w->cb(w->fd, w->data);
-				if (ret < 0) {
-					fprintf(stderr, "cb returned %d\n", ret);
-					goto done;
-				}
+		for (i = 0, n = ret; i < n; i++) {
+			ret = watch_dispatch(events[i].data.ptr, events[i].events);
+			if (ret < 0) {
+				fprintf(stderr, "cb returned %d\n", ret);
+				goto done;
 			}
 		}
+
+		ret = watch_dispatch_always_ready();
+		if (ret < 0) {
+			fprintf(stderr, "cb returned %d\n", ret);
+			goto done;
+		}
+
+		watch_reap();
 	}
 
 done:
@@ -418,5 +1473,8 @@ done:
 	if (selected_device)
 		device_close(selected_device);
 
+	/* Deliver whatever is still queued for the client before exiting */
+	outq_wait(CDBA_OUTQ_SIZE - 1, CDBA_OUTQ_DRAIN_MS);
+
 	return 0;
 }
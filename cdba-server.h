@@ -1,17 +1,27 @@
 #ifndef __BAD_H__
 #define __BAD_H__
 
+#include <sys/uio.h>
 #include <stdbool.h>
 #include <termios.h>
 
 #include "cdba.h"
 
 void watch_add_readfd(int fd, int (*cb)(int, void*), void *data);
+void watch_add_writefd(int fd, int (*cb)(int, void*), void *data);
+void watch_del_readfd(int fd);
+void watch_del_writefd(int fd);
 int watch_add_quit(int (*cb)(int, void*), void *data);
-void watch_timer_add(int timeout_ms, void (*cb)(void *), void *data);
+struct timer;
+
+struct timer *watch_timer_add(int timeout_ms, void (*cb)(void *), void *data);
+void watch_timer_cancel(struct timer *t);
 void watch_quit(void);
 int watch_run(void);
 
 int tty_open(const char *tty, struct termios *old);
 
+void cdba_send(int type, const void *data, size_t len);
+void cdba_sendv(int type, const struct iovec *data, int count);
+
 #endif
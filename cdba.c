@@ -28,12 +28,15 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <alloca.h>
+#include <endian.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -46,12 +49,18 @@
 
 #include "cdba.h"
 #include "circ_buf.h"
+#include "delta.h"
 #include "list.h"
+#include "msg.h"
+#include "sha256.h"
 
 static bool quit;
 static bool fastboot_repeat;
 static bool fastboot_done;
 
+/* Set once the image has been offered to the server in this session */
+static bool fastboot_uploaded;
+
 static const char *fastboot_file;
 
 static struct termios *tty_unbuffer(void)
@@ -144,99 +153,348 @@ static int fork_ssh(const char *host, const char *cmd, int *pipes)
 	return 0;
 }
 
+/* Tail of a frame only partially accepted by the ssh pipe */
+static char *ssh_partial;
+static size_t ssh_partial_off;
+static size_t ssh_partial_len;
+
+/**
+ * ssh_flush() - send the remainder of a partially written frame
+ * @fd:		ssh stdin
+ *
+ * Return: 0 once the frame is complete, -1 with errno set otherwise
+ */
+static int ssh_flush(int fd)
+{
+	ssize_t n;
+
+	while (ssh_partial_off < ssh_partial_len) {
+		n = write(fd, ssh_partial + ssh_partial_off,
+			  ssh_partial_len - ssh_partial_off);
+		if (n < 0)
+			return -1;
+
+		ssh_partial_off += n;
+	}
+
+	ssh_partial_off = 0;
+	ssh_partial_len = 0;
+
+	return 0;
+}
+
+/* Room for the frame header and the largest payload iovec array used */
+#define SSH_SEND_IOV_MAX	3
+
+/**
+ * ssh_sendv() - send a message to the server
+ * @fd:		ssh stdin
+ * @type:	message type
+ * @data:	payload fragments
+ * @count:	number of entries in @data
+ *
+ * Frames are encoded according to the negotiated protocol version. A frame
+ * only partially accepted by the pipe is completed before any other frame.
+ *
+ * Return: 0 if the frame was sent, -1 with errno set otherwise, where EAGAIN
+ * means that nothing was sent and the request should be retried
+ */
+static int ssh_sendv(int fd, int type, const struct iovec *data, int count)
+{
+	struct iovec iov[SSH_SEND_IOV_MAX + 1];
+	char hdr[MSG_HDR_MAX];
+	size_t total;
+	size_t len = 0;
+	size_t skip;
+	ssize_t n;
+	char *p;
+	int i;
+
+	if (ssh_flush(fd) < 0)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		iov[i + 1] = data[i];
+		len += data[i].iov_len;
+	}
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = msg_hdr_encode(hdr, type, len);
+	total = iov[0].iov_len + len;
+
+	n = writev(fd, iov, count + 1);
+	if (n < 0)
+		return -1;
+
+	if (n == total)
+		return 0;
+
+	ssh_partial = realloc(ssh_partial, total - n);
+	if (!ssh_partial)
+		err(1, "failed to allocate partial frame");
+
+	p = ssh_partial;
+	for (i = 0; i < count + 1; i++) {
+		skip = MIN(n, iov[i].iov_len);
+		memcpy(p, iov[i].iov_base + skip, iov[i].iov_len - skip);
+		p += iov[i].iov_len - skip;
+		n -= skip;
+	}
+
+	ssh_partial_off = 0;
+	ssh_partial_len = p - ssh_partial;
+
+	return 0;
+}
+
+static int ssh_send(int fd, int type, const void *data, size_t len)
+{
+	struct iovec iov = { (void *)data, len };
+
+	return ssh_sendv(fd, type, &iov, 1);
+}
+
+/*
+ * Outgoing requests are queued as work items. Interactive items, keystrokes
+ * and control requests, are sent in order and preempt bulk transfers at frame
+ * boundaries. The fn of a work item returns -EAGAIN if nothing was sent, in
+ * which case the item is retried first when ssh stdin is writable again.
+ */
+struct work {
+	int (*fn)(struct work *work, int ssh_stdin);
+
+	struct list_head node;
+};
+
+static struct list_head work_items = LIST_INIT(work_items);
+static struct list_head bulk_items = LIST_INIT(bulk_items);
+
+/* Bulk frame payload while a terminal is attached, to bound keystroke latency */
+#define BULK_CHUNK_INTERACTIVE	(16 * 1024)
+
+static bool tty_attached;
+
+static size_t bulk_chunk(void)
+{
+	if (tty_attached)
+		return MIN(msg_bulk_len(), BULK_CHUNK_INTERACTIVE);
+
+	return msg_bulk_len();
+}
+
+static void ssh_schedule(int ssh_stdin)
+{
+	struct work *work;
+	int ret;
+
+	ret = ssh_flush(ssh_stdin);
+	if (ret < 0 && errno == EAGAIN)
+		return;
+	else if (ret < 0)
+		err(1, "failed to write to ssh");
+
+	while (!list_empty(&work_items)) {
+		work = list_entry_first(&work_items, struct work, node);
+		list_del(&work->node);
+
+		ret = work->fn(work, ssh_stdin);
+		if (ret == -EAGAIN) {
+			list_add(work_items.next, &work->node);
+			return;
+		}
+
+		if (ssh_partial_len)
+			return;
+	}
+
+	/* A single bulk frame per round, so that keystrokes are read in between */
+	if (!list_empty(&bulk_items)) {
+		work = list_entry_first(&bulk_items, struct work, node);
+		list_del(&work->node);
+
+		ret = work->fn(work, ssh_stdin);
+		if (ret == -EAGAIN)
+			list_add(bulk_items.next, &work->node);
+	}
+}
+
+static bool ssh_pending(void)
+{
+	return !list_empty(&work_items) || !list_empty(&bulk_items) ||
+	       ssh_partial_len;
+}
+
+struct msg_work {
+	struct work work;
+
+	int type;
+};
+
+static int msg_work_fn(struct work *_work, int ssh_stdin)
+{
+	struct msg_work *work = container_of(_work, struct msg_work, work);
+	int ret;
+
+	ret = ssh_send(ssh_stdin, work->type, NULL, 0);
+	if (ret < 0 && errno == EAGAIN)
+		return -EAGAIN;
+	else if (ret < 0)
+		err(1, "failed to send request");
+
+	free(work);
+	return 0;
+}
+
+static void request_msg(int type)
+{
+	struct msg_work *work;
+
+	work = malloc(sizeof(*work));
+	work->work.fn = msg_work_fn;
+	work->type = type;
+
+	list_add(&work_items, &work->work.node);
+}
+
+#define CONSOLE_WORK_SIZE	4096
+
+struct console_work {
+	struct work work;
+
+	size_t len;
+	char data[CONSOLE_WORK_SIZE];
+};
+
+static int console_work_fn(struct work *_work, int ssh_stdin)
+{
+	struct console_work *work = container_of(_work, struct console_work, work);
+	int ret;
+
+	ret = ssh_send(ssh_stdin, MSG_CONSOLE, work->data, work->len);
+	if (ret < 0 && errno == EAGAIN)
+		return -EAGAIN;
+	else if (ret < 0)
+		err(1, "failed to send console data");
+
+	free(work);
+	return 0;
+}
+
+/*
+ * Queue keystrokes for the console, appending to the most recently queued
+ * console frame if nothing has been queued after it.
+ */
+static void request_console(const void *data, size_t len)
+{
+	struct console_work *work = NULL;
+	struct work *last;
+	size_t n;
+
+	while (len) {
+		if (!list_empty(&work_items)) {
+			last = list_entry(work_items.prev, struct work, node);
+			if (last->fn == console_work_fn)
+				work = container_of(last, struct console_work, work);
+		}
+
+		if (!work || work->len == CONSOLE_WORK_SIZE) {
+			work = malloc(sizeof(*work));
+			work->work.fn = console_work_fn;
+			work->len = 0;
+
+			list_add(&work_items, &work->work.node);
+		}
+
+		n = MIN(len, CONSOLE_WORK_SIZE - work->len);
+		memcpy(work->data + work->len, data, n);
+		work->len += n;
+
+		data += n;
+		len -= n;
+	}
+}
+
+#define TTY_READ_SIZE	4096
+
 static int tty_callback(int *ssh_fds)
 {
 	static bool special;
-	struct msg hdr;
-	char buf[32];
-	ssize_t k;
+	char buf[TTY_READ_SIZE];
+	char *end;
+	char *p;
+	char *s;
 	ssize_t n;
 
 	n = read(STDIN_FILENO, buf, sizeof(buf));
 	if (n < 0)
 		return n;
 
-	for (k = 0; k < n; k++) {
-		if (buf[k] == 0x1) {
-			special = true;
-		} else if (special) {
-			switch (buf[k]) {
+	p = buf;
+	end = buf + n;
+	while (p < end) {
+		if (special) {
+			switch (*p) {
 			case 'q':
 				quit = true;
 				break;
 			case 'P':
-				hdr.type = MSG_POWER_ON;
-				hdr.len = 0;
-				write(ssh_fds[0], &hdr, sizeof(hdr));
+				request_msg(MSG_POWER_ON);
 				break;
 			case 'p':
-				hdr.type = MSG_POWER_OFF;
-				hdr.len = 0;
-				write(ssh_fds[0], &hdr, sizeof(hdr));
+				request_msg(MSG_POWER_OFF);
 				break;
 			case 's':
-				hdr.type = MSG_STATUS_UPDATE;
-				hdr.len = 0;
-				write(ssh_fds[0], &hdr, sizeof(hdr));
+				request_msg(MSG_STATUS_UPDATE);
 				break;
 			case 'V':
-				hdr.type = MSG_VBUS_ON;
-				hdr.len = 0;
-				write(ssh_fds[0], &hdr, sizeof(hdr));
+				request_msg(MSG_VBUS_ON);
 				break;
 			case 'v':
-				hdr.type = MSG_VBUS_OFF;
-				hdr.len = 0;
-				write(ssh_fds[0], &hdr, sizeof(hdr));
+				request_msg(MSG_VBUS_OFF);
 				break;
 			case 'a':
-				hdr.type = MSG_CONSOLE;
-				hdr.len = 1;
-
-				write(ssh_fds[0], &hdr, sizeof(hdr));
-				write(ssh_fds[0], "\001", 1);
+				request_console("\001", 1);
 				break;
 			case 'B':
-				hdr.type = MSG_SEND_BREAK;
-				hdr.len = 0;
-				write(ssh_fds[0], &hdr, sizeof(hdr));
+				request_msg(MSG_SEND_BREAK);
 				break;
 			}
 
 			special = false;
-		} else {
-			hdr.type = MSG_CONSOLE;
-			hdr.len = 1;
+			p++;
+			continue;
+		}
 
-			write(ssh_fds[0], &hdr, sizeof(hdr));
-			write(ssh_fds[0], buf + k, 1);
+		/* Forward everything up to the next escape as a single run */
+		s = memchr(p, 0x1, end - p);
+		if (!s) {
+			request_console(p, end - p);
+			break;
 		}
+
+		if (s > p)
+			request_console(p, s - p);
+
+		special = true;
+		p = s + 1;
 	}
 
 	return 0;
 }
 
-struct work {
-	void (*fn)(struct work *work, int ssh_stdin);
-
-	struct list_head node;
-};
-
-static struct list_head work_items = LIST_INIT(work_items);
-
-static void list_boards_fn(struct work *work, int ssh_stdin)
+static int list_boards_fn(struct work *work, int ssh_stdin)
 {
-	struct msg msg;
-	ssize_t n;
-
-	msg.type = MSG_LIST_DEVICES;
-	msg.len = 0;
+	int ret;
 
-	n = write(ssh_stdin, &msg, sizeof(msg));
-	if (n < 0)
+	ret = ssh_send(ssh_stdin, MSG_LIST_DEVICES, NULL, 0);
+	if (ret < 0 && errno == EAGAIN)
+		return -EAGAIN;
+	else if (ret < 0)
 		err(1, "failed to send board list request");
 
 	free(work);
+
+	return 0;
 }
 
 static void request_board_list(void)
@@ -254,23 +512,21 @@ struct board_info_request {
 	const char *board;
 };
 
-static void board_info_fn(struct work *work, int ssh_stdin)
+static int board_info_fn(struct work *work, int ssh_stdin)
 {
 	struct board_info_request *board = container_of(work, struct board_info_request, work);
 	size_t blen = strlen(board->board) + 1;
-	struct msg *msg;
-	ssize_t n;
-
-	msg = alloca(sizeof(*msg) + blen);
-	msg->type = MSG_BOARD_INFO;
-	msg->len = blen;
-	memcpy(msg->data, board->board, blen);
+	int ret;
 
-	n = write(ssh_stdin, msg, sizeof(*msg) + blen);
-	if (n < 0)
+	ret = ssh_send(ssh_stdin, MSG_BOARD_INFO, board->board, blen);
+	if (ret < 0 && errno == EAGAIN)
+		return -EAGAIN;
+	else if (ret < 0)
 		err(1, "failed to send board info request");
 
 	free(work);
+
+	return 0;
 }
 
 static void request_board_info(const char *board)
@@ -290,23 +546,40 @@ struct select_board {
 	const char *board;
 };
 
-static void select_board_fn(struct work *work, int ssh_stdin)
+/* Set while waiting for the server to reply to the hello in MSG_SELECT_BOARD */
+static bool select_pending;
+
+/* Fastboot device reported present while select_pending */
+static bool fastboot_present_early;
+
+static int select_board_fn(struct work *work, int ssh_stdin)
 {
 	struct select_board *board = container_of(work, struct select_board, work);
 	size_t blen = strlen(board->board) + 1;
-	struct msg *msg;
-	ssize_t n;
+	struct msg_hello hello;
+	struct iovec iov[2];
+	int ret;
 
-	msg = alloca(sizeof(*msg) + blen);
-	msg->type = MSG_SELECT_BOARD;
-	msg->len = blen;
-	memcpy(msg->data, board->board, blen);
+	/* Old servers ignore the hello following the board name */
+	hello.version = CDBA_PROTOCOL_V2;
+	hello.len_max = htole32(MSG_V2_LEN_MAX);
 
-	n = write(ssh_stdin, msg, sizeof(*msg) + blen);
-	if (n < 0)
+	iov[0].iov_base = (void *)board->board;
+	iov[0].iov_len = blen;
+	iov[1].iov_base = &hello;
+	iov[1].iov_len = sizeof(hello);
+
+	ret = ssh_sendv(ssh_stdin, MSG_SELECT_BOARD, iov, 2);
+	if (ret < 0 && errno == EAGAIN)
+		return -EAGAIN;
+	else if (ret < 0)
 		err(1, "failed to send power on request");
 
+	select_pending = true;
+
 	free(work);
+
+	return 0;
 }
 
 static void request_select_board(const char *board)
@@ -320,24 +593,30 @@ static void request_select_board(const char *board)
 	list_add(&work_items, &work->work.node);
 }
 
-static void request_power_on_fn(struct work *work, int ssh_stdin)
+static int request_power_on_fn(struct work *work, int ssh_stdin)
 {
-	struct msg msg = { MSG_POWER_ON, };
-	ssize_t n;
+	int ret;
 
-	n = write(ssh_stdin, &msg, sizeof(msg));
-	if (n < 0)
+	ret = ssh_send(ssh_stdin, MSG_POWER_ON, NULL, 0);
+	if (ret < 0 && errno == EAGAIN)
+		return -EAGAIN;
+	else if (ret < 0)
 		err(1, "failed to send power on request");
+
+	return 0;
 }
 
-static void request_power_off_fn(struct work *work, int ssh_stdin)
+static int request_power_off_fn(struct work *work, int ssh_stdin)
 {
-	struct msg msg = { MSG_POWER_OFF, };
-	ssize_t n;
+	int ret;
 
-	n = write(ssh_stdin, &msg, sizeof(msg));
-	if (n < 0)
+	ret = ssh_send(ssh_stdin, MSG_POWER_OFF, NULL, 0);
+	if (ret < 0 && errno == EAGAIN)
+		return -EAGAIN;
+	else if (ret < 0)
 		err(1, "failed to send power off request");
+
+	return 0;
 }
 
 static void request_power_on(void)
@@ -354,66 +633,541 @@ static void request_power_off(void)
 	list_add(&work_items, &work.node);
 }
 
+/*
+ * Map the image rather than reading it into memory, so that large images are
+ * uploaded straight from the page cache.
+ */
+static void *fastboot_map(const char *path, size_t *size)
+{
+	struct stat sb;
+	void *ptr;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		err(1, "failed to open \"%s\"", path);
+
+	if (fstat(fd, &sb) < 0)
+		err(1, "failed to stat \"%s\"", path);
+
+	*size = sb.st_size;
+	if (!*size) {
+		close(fd);
+		return NULL;
+	}
+
+	ptr = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (ptr == MAP_FAILED)
+		err(1, "failed to map \"%s\"", path);
+
+	madvise(ptr, *size, MADV_SEQUENTIAL);
+
+	close(fd);
+
+	return ptr;
+}
+
+static void fastboot_unmap(void *ptr, size_t size)
+{
+	if (ptr)
+		munmap(ptr, size);
+}
+
+/*
+ * Upload credit granted by version 2 servers. Uploads stall once it runs out,
+ * until the server has staged enough of the data already sent.
+ */
+static size_t fastboot_credit;
+static struct work *fastboot_credit_wait;
+
+/**
+ * fastboot_credit_take() - claim credit for sending upload data
+ * @work:	upload work item, parked until more credit arrives if needed
+ * @min:	smallest number of bytes worth sending
+ * @len:	number of bytes to send
+ *
+ * Return: number of bytes that may be sent, 0 if @work was parked
+ */
+static size_t fastboot_credit_take(struct work *work, size_t min, size_t len)
+{
+	if (msg_version() < CDBA_PROTOCOL_V2)
+		return len;
+
+	if (fastboot_credit < min) {
+		fastboot_credit_wait = work;
+		return 0;
+	}
+
+	len = MIN(len, fastboot_credit);
+	fastboot_credit -= len;
+
+	return len;
+}
+
+static void fastboot_credit_untake(size_t len)
+{
+	if (msg_version() >= CDBA_PROTOCOL_V2)
+		fastboot_credit += len;
+}
+
 struct fastboot_download_work {
 	struct work work;
 
 	void *data;
 	size_t offset;
 	size_t size;
+	bool size_sent;
 };
 
-static void fastboot_work_fn(struct work *_work, int ssh_stdin)
+static int fastboot_size_fn(struct fastboot_download_work *work, int ssh_stdin)
+{
+	uint32_t size = htole32(work->size);
+	int ret;
+
+	ret = ssh_send(ssh_stdin, MSG_FASTBOOT_DOWNLOAD_SIZE, &size, sizeof(size));
+	if (ret < 0 && errno == EAGAIN)
+		return -EAGAIN;
+	else if (ret < 0)
+		err(1, "failed to write fastboot download size");
+
+	work->size_sent = true;
+	list_add(&bulk_items, &work->work.node);
+
+	return 0;
+}
+
+static int fastboot_work_fn(struct work *_work, int ssh_stdin)
 {
 	struct fastboot_download_work *work = container_of(_work, struct fastboot_download_work, work);
-	struct msg *msg;
 	size_t left;
-	ssize_t n;
+	int ret;
 
-	left = MIN(2048, work->size - work->offset);
+	/* Announce the image size, so the server can start streaming to the device */
+	if (!work->size_sent)
+		return fastboot_size_fn(work, ssh_stdin);
 
-	msg = alloca(sizeof(*msg) + left);
-	msg->type = MSG_FASTBOOT_DOWNLOAD;
-	msg->len = left;
-	memcpy(msg->data, work->data + work->offset, left);
+	left = MIN(bulk_chunk(), work->size - work->offset);
+	if (left) {
+		left = fastboot_credit_take(_work, 1, left);
+		if (!left)
+			return 0;
+	}
 
-	n = write(ssh_stdin, msg, sizeof(*msg) + msg->len);
-	if (n < 0 && errno == EAGAIN) {
-		list_add(&work_items, &_work->node);
-		return;
-	} else if (n < 0) {
+	/* Send the payload straight from the mapped image */
+	ret = ssh_send(ssh_stdin, MSG_FASTBOOT_DOWNLOAD, work->data + work->offset, left);
+	if (ret < 0 && errno == EAGAIN) {
+		fastboot_credit_untake(left);
+		return -EAGAIN;
+	} else if (ret < 0) {
 		err(1, "failed to write fastboot message");
 	}
 
-	work->offset += msg->len;
+	work->offset += left;
 
 	/* We've sent the entire image, and a zero length packet */
-	if (!msg->len)
+	if (!left) {
+		fastboot_unmap(work->data, work->size);
 		free(work);
-	else
-		list_add(&work_items, &_work->node);
+	} else {
+		list_add(&bulk_items, &_work->node);
+	}
+
+	return 0;
+}
+
+struct fastboot_digest_work {
+	struct work work;
+
+	uint32_t size;
+	uint8_t digest[SHA256_DIGEST_SIZE];
+
+	const void *data;
+	size_t offset;
+	struct sha256 sha;
+};
+
+static struct fastboot_download_work *fastboot_pending;
+
+/* Image bytes to hash per main loop iteration */
+#define FASTBOOT_HASH_STEP	(4 * 1024 * 1024)
+
+/* Digest being computed, queued once the whole image has been hashed */
+static struct fastboot_digest_work *fastboot_hashing;
+
+static int fastboot_digest_fn(struct work *_work, int ssh_stdin)
+{
+	struct fastboot_digest_work *work = container_of(_work, struct fastboot_digest_work, work);
+	uint32_t size = htole32(work->size);
+	struct iovec iov[2];
+	int ret;
+
+	iov[0].iov_base = &size;
+	iov[0].iov_len = sizeof(size);
+	iov[1].iov_base = work->digest;
+	iov[1].iov_len = sizeof(work->digest);
+
+	ret = ssh_sendv(ssh_stdin, MSG_FASTBOOT_DIGEST, iov, 2);
+	if (ret < 0 && errno == EAGAIN)
+		return -EAGAIN;
+	else if (ret < 0)
+		err(1, "failed to write fastboot digest");
+
+	free(work);
+	return 0;
 }
 
 static void request_fastboot_files(void)
 {
+	struct fastboot_digest_work *digest;
 	struct fastboot_download_work *work;
-	struct stat sb;
-	int fd;
 
 	work = calloc(1, sizeof(*work));
 	work->work.fn = fastboot_work_fn;
+	work->data = fastboot_map(fastboot_file, &work->size);
 
-	fd = open(fastboot_file, O_RDONLY);
-	if (fd < 0)
-		err(1, "failed to open \"%s\"", fastboot_file);
+	fastboot_uploaded = true;
 
-	fstat(fd, &sb);
+	/* Version 1 servers only take the image as a plain download stream */
+	if (msg_version() < CDBA_PROTOCOL_V2) {
+		work->size_sent = true;
+		list_add(&bulk_items, &work->work.node);
+		return;
+	}
 
-	work->size = sb.st_size;
-	work->data = malloc(work->size);
-	read(fd, work->data, work->size);
-	close(fd);
+	/*
+	 * Ask the server to look for the image in its cache, the upload is
+	 * only performed if the server doesn't already have the image.
+	 */
+	digest = calloc(1, sizeof(*digest));
+	digest->work.fn = fastboot_digest_fn;
+	digest->size = work->size;
 
-	list_add(&work_items, &work->work.node);
+	digest->data = work->data;
+	sha256_init(&digest->sha);
+
+	fastboot_pending = work;
+	fastboot_hashing = digest;
+}
+
+/*
+ * Hash the next part of the image. Large images take seconds to hash, so the
+ * work is spread over main loop iterations to keep the console, stderr and
+ * timeouts serviced meanwhile.
+ */
+static void fastboot_hash_step(void)
+{
+	struct fastboot_digest_work *digest = fastboot_hashing;
+	size_t n;
+
+	n = MIN(digest->size - digest->offset, FASTBOOT_HASH_STEP);
+	sha256_update(&digest->sha, digest->data + digest->offset, n);
+	digest->offset += n;
+
+	if (digest->offset < digest->size)
+		return;
+
+	sha256_final(&digest->sha, digest->digest);
+	fastboot_hashing = NULL;
+
+	list_add(&work_items, &digest->work.node);
+}
+
+static int fastboot_boot_fn(struct work *work, int ssh_stdin)
+{
+	int ret;
+
+	ret = ssh_send(ssh_stdin, MSG_FASTBOOT_BOOT, NULL, 0);
+	if (ret < 0 && errno == EAGAIN)
+		return -EAGAIN;
+	else if (ret < 0)
+		err(1, "failed to write fastboot boot request");
+
+	return 0;
+}
+
+/*
+ * Ask the server to boot the image it retained from the previous download,
+ * rather than uploading the same image again.
+ */
+static void request_fastboot_boot(void)
+{
+	static struct work work = { .fn = fastboot_boot_fn };
+
+	/* Version 1 servers don't retain the image, upload it again */
+	if (msg_version() < CDBA_PROTOCOL_V2) {
+		request_fastboot_files();
+		return;
+	}
+
+	list_add(&work_items, &work.node);
+}
+
+static void handle_fastboot_boot(const void *data, size_t len)
+{
+	const uint8_t *retained = data;
+
+	/* The server lost the image, fall back to uploading it */
+	if (len && !*retained)
+		request_fastboot_files();
+}
+
+struct fastboot_delta_op {
+	int op;
+	size_t arg0;
+	size_t arg1;
+};
+
+struct fastboot_delta_work {
+	struct work work;
+
+	void *data;
+	size_t size;
+	struct fastboot_delta_op *ops;
+	size_t count;
+	size_t idx;
+	size_t offset;
+
+	/* Scan of the image against the server's block signatures */
+	struct delta_state delta;
+	struct delta_sig *sigs;
+};
+
+/* Image bytes to scan for matching blocks per main loop iteration */
+#define FASTBOOT_DELTA_STEP	(1024 * 1024)
+
+/* Delta being generated, queued once the whole image has been scanned */
+static struct fastboot_delta_work *fastboot_scanning;
+
+static struct delta_sig *fastboot_sigs;
+static size_t fastboot_sig_count;
+static size_t fastboot_sig_received;
+static size_t fastboot_sig_block;
+
+static int fastboot_delta_fn(struct work *_work, int ssh_stdin)
+{
+	struct fastboot_delta_work *work = container_of(_work, struct fastboot_delta_work, work);
+	struct fastboot_delta_op *op = &work->ops[work->idx];
+	const uint8_t literal = DELTA_OP_LITERAL;
+	struct delta_copy copy;
+	struct iovec iov[2];
+	size_t claimed = 0;
+	size_t left = 0;
+	int count = 0;
+	int ret;
+
+	if (work->idx == work->count) {
+		/* Terminate the delta with an empty frame */
+	} else if (op->op == DELTA_OP_COPY) {
+		claimed = fastboot_credit_take(_work, sizeof(copy), sizeof(copy));
+		if (!claimed)
+			return 0;
+
+		copy.op = DELTA_OP_COPY;
+		copy.block = htole32(op->arg0);
+		copy.count = htole32(op->arg1);
+
+		iov[0].iov_base = &copy;
+		iov[0].iov_len = sizeof(copy);
+		count = 1;
+	} else {
+		left = MIN(bulk_chunk() - 1, op->arg1 - work->offset);
+		claimed = fastboot_credit_take(_work, 2, left + 1);
+		if (!claimed)
+			return 0;
+		left = claimed - 1;
+
+		iov[0].iov_base = (void *)&literal;
+		iov[0].iov_len = 1;
+		iov[1].iov_base = work->data + op->arg0 + work->offset;
+		iov[1].iov_len = left;
+		count = 2;
+	}
+
+	ret = ssh_sendv(ssh_stdin, MSG_FASTBOOT_DELTA, count ? iov : NULL, count);
+	if (ret < 0 && errno == EAGAIN) {
+		fastboot_credit_untake(claimed);
+		return -EAGAIN;
+	} else if (ret < 0) {
+		err(1, "failed to write fastboot delta message");
+	}
+
+	/* We've sent the entire delta, and a zero length packet */
+	if (!count) {
+		free(work->ops);
+		fastboot_unmap(work->data, work->size);
+		free(work);
+		return 0;
+	}
+
+	work->offset += left;
+	if (op->op == DELTA_OP_COPY || work->offset == op->arg1) {
+		work->idx++;
+		work->offset = 0;
+	}
+
+	list_add(&bulk_items, &_work->node);
+
+	return 0;
+}
+
+static void fastboot_delta_add(struct fastboot_delta_work *work, int type,
+			       size_t arg0, size_t arg1)
+{
+	struct fastboot_delta_op *ops;
+
+	ops = realloc(work->ops, (work->count + 1) * sizeof(*ops));
+	if (!ops)
+		err(1, "failed to allocate delta operations");
+
+	ops[work->count].op = type;
+	ops[work->count].arg0 = arg0;
+	ops[work->count].arg1 = arg1;
+
+	work->ops = ops;
+	work->count++;
+}
+
+static void fastboot_delta_copy(size_t block, size_t count, void *data)
+{
+	fastboot_delta_add(data, DELTA_OP_COPY, block, count);
+}
+
+static void fastboot_delta_literal(size_t offset, size_t len, void *data)
+{
+	fastboot_delta_add(data, DELTA_OP_LITERAL, offset, len);
+}
+
+static const struct delta_ops fastboot_delta_ops = {
+	.copy = fastboot_delta_copy,
+	.literal = fastboot_delta_literal,
+};
+
+/* Describe the image as a delta, taking ownership of the signatures */
+static void request_fastboot_delta(void)
+{
+	struct fastboot_download_work *download = fastboot_pending;
+	struct fastboot_delta_work *work;
+
+	fastboot_pending = NULL;
+
+	work = calloc(1, sizeof(*work));
+	work->work.fn = fastboot_delta_fn;
+	work->data = download->data;
+	work->size = download->size;
+	work->sigs = fastboot_sigs;
+
+	delta_init(&work->delta, work->data, work->size,
+		   fastboot_sigs, fastboot_sig_count, fastboot_sig_block);
+
+	fastboot_sigs = NULL;
+	fastboot_scanning = work;
+
+	free(download);
+}
+
+/*
+ * Scan the next part of the image for blocks of the server's image. Like
+ * hashing, the scan takes seconds for large images and is spread over main
+ * loop iterations.
+ */
+static void fastboot_delta_step(void)
+{
+	struct fastboot_delta_work *work = fastboot_scanning;
+
+	if (!delta_step(&work->delta, FASTBOOT_DELTA_STEP, &fastboot_delta_ops, work))
+		return;
+
+	free(work->sigs);
+	work->sigs = NULL;
+	fastboot_scanning = NULL;
+
+	list_add(&bulk_items, &work->work.node);
+}
+
+static void handle_fastboot_digest(const void *data, size_t len)
+{
+	struct fastboot_download_work *work = fastboot_pending;
+	const uint8_t *result = data;
+
+	if (!work || !len)
+		return;
+
+	/* Credit for the upload is granted following the reply */
+	fastboot_credit = 0;
+
+	switch (*result) {
+	case FASTBOOT_DIGEST_HIT:
+		fastboot_pending = NULL;
+		fastboot_unmap(work->data, work->size);
+		free(work);
+		break;
+	case FASTBOOT_DIGEST_MISS:
+		fastboot_pending = NULL;
+		list_add(&bulk_items, &work->work.node);
+		break;
+	case FASTBOOT_DIGEST_DELTA:
+		/* Wait for the block signatures of the server's image */
+		break;
+	}
+}
+
+static void handle_fastboot_credit(const void *data, size_t len)
+{
+	uint32_t grant;
+
+	if (len != sizeof(grant))
+		return;
+
+	memcpy(&grant, data, sizeof(grant));
+	fastboot_credit += le32toh(grant);
+
+	if (fastboot_credit_wait) {
+		list_add(&bulk_items, &fastboot_credit_wait->node);
+		fastboot_credit_wait = NULL;
+	}
+}
+
+static void handle_fastboot_delta_signature(const void *data, size_t len)
+{
+	struct delta_sig_hdr hdr;
+	struct delta_sig *sigs;
+	size_t count;
+	size_t i;
+
+	if (!fastboot_sigs) {
+		if (len != sizeof(hdr))
+			errx(1, "malformed delta signature header");
+
+		memcpy(&hdr, data, sizeof(hdr));
+
+		fastboot_sig_block = le32toh(hdr.block_size);
+		fastboot_sig_count = le32toh(hdr.count);
+		fastboot_sig_received = 0;
+
+		fastboot_sigs = calloc(fastboot_sig_count + 1, sizeof(*fastboot_sigs));
+		if (!fastboot_sigs)
+			err(1, "failed to allocate delta signatures");
+		return;
+	}
+
+	if (len) {
+		count = len / sizeof(*fastboot_sigs);
+		if (count > fastboot_sig_count - fastboot_sig_received)
+			errx(1, "received excess delta signatures");
+
+		sigs = &fastboot_sigs[fastboot_sig_received];
+		memcpy(sigs, data, count * sizeof(*fastboot_sigs));
+		for (i = 0; i < count; i++)
+			sigs[i].weak = le32toh(sigs[i].weak);
+
+		fastboot_sig_received += count;
+		return;
+	}
+
+	if (fastboot_sig_received != fastboot_sig_count)
+		errx(1, "received incomplete delta signatures");
+
+	request_fastboot_delta();
 }
 
 static void handle_status_update(const void *data, size_t len)
@@ -478,32 +1232,54 @@ static void handle_console(const void *data, size_t len)
 
 static bool auto_power_on;
 
+static void handle_select_board(const void *data, size_t len)
+{
+	struct msg_hello hello;
+
+	select_pending = false;
+
+	/* Old servers send an empty reply, keep speaking version 1 to them */
+	if (len < sizeof(hello))
+		return;
+
+	memcpy(&hello, data, sizeof(hello));
+	if (hello.version >= CDBA_PROTOCOL_V2)
+		msg_set_version(CDBA_PROTOCOL_V2, le32toh(hello.len_max));
+}
+
 static int handle_message(struct circ_buf *buf)
 {
-	struct msg *msg;
-	struct msg hdr;
-	size_t n;
+	struct msg_hdr hdr;
+	const void *data;
 
 	for (;;) {
-		n = circ_peak(buf, &hdr, sizeof(hdr));
-		if (n != sizeof(hdr))
-			return 0;
-
-		if (CIRC_AVAIL(buf) < sizeof(*msg) + hdr.len)
+		if (!msg_frame_next(buf, &hdr, &data))
 			return 0;
 
-		// fprintf(stderr, "avail: %zd hdr.len: %d\n", CIRC_AVAIL(buf), hdr.len);
+		// fprintf(stderr, "avail: %zu hdr.len: %zu\n", CIRC_AVAIL(buf), hdr.len);
 
-		msg = malloc(sizeof(*msg) + hdr.len);
-		circ_read(buf, msg, sizeof(*msg) + hdr.len);
-
-		switch (msg->type) {
+		switch (hdr.type) {
 		case MSG_SELECT_BOARD:
 			// printf("======================================== MSG_SELECT_BOARD\n");
+			handle_select_board(data, hdr.len);
 			request_power_on();
+
+			/*
+			 * Upload while the board powers up, the server holds on to
+			 * the image. Version 1 servers need the board in fastboot
+			 * before the upload starts.
+			 */
+			if (fastboot_file && !fastboot_uploaded &&
+			    msg_version() >= CDBA_PROTOCOL_V2)
+				request_fastboot_files();
+
+			/* The board was in fastboot before the protocol was settled */
+			if (fastboot_present_early && !fastboot_uploaded)
+				request_fastboot_files();
+			fastboot_present_early = false;
 			break;
 		case MSG_CONSOLE:
-			handle_console(msg->data, msg->len);
+			handle_console(data, hdr.len);
 			break;
 		case MSG_HARDRESET:
 			break;
@@ -518,11 +1294,15 @@ static int handle_message(struct circ_buf *buf)
 			}
 			break;
 		case MSG_FASTBOOT_PRESENT:
-			if (*(uint8_t*)msg->data) {
+			if (*(const uint8_t *)data && select_pending) {
+				fastboot_present_early = true;
+			} else if (*(const uint8_t *)data) {
 				// printf("======================================== MSG_FASTBOOT_PRESENT(on)\n");
-				if (!fastboot_done || fastboot_repeat)
+				if (!fastboot_uploaded)
 					request_fastboot_files();
-				else
+				else if (fastboot_done && fastboot_repeat)
+					request_fastboot_boot();
+				else if (fastboot_done)
 					quit = true;
 			} else {
 				fastboot_done = true;
@@ -532,25 +1312,33 @@ static int handle_message(struct circ_buf *buf)
 		case MSG_FASTBOOT_DOWNLOAD:
 			// printf("======================================== MSG_FASTBOOT_DOWNLOAD\n");
 			break;
+		case MSG_FASTBOOT_DIGEST:
+			handle_fastboot_digest(data, hdr.len);
+			break;
+		case MSG_FASTBOOT_DELTA_SIGNATURE:
+			handle_fastboot_delta_signature(data, hdr.len);
+			break;
+		case MSG_FASTBOOT_CREDIT:
+			handle_fastboot_credit(data, hdr.len);
+			break;
 		case MSG_FASTBOOT_BOOT:
 			// printf("======================================== MSG_FASTBOOT_BOOT\n");
+			handle_fastboot_boot(data, hdr.len);
 			break;
 		case MSG_STATUS_UPDATE:
-			handle_status_update(msg->data, msg->len);
+			handle_status_update(data, hdr.len);
 			break;
 		case MSG_LIST_DEVICES:
-			handle_list_devices(msg->data, msg->len);
+			handle_list_devices(data, hdr.len);
 			break;
 		case MSG_BOARD_INFO:
-			handle_board_info(msg->data, msg->len);
+			handle_board_info(data, hdr.len);
 			return -1;
 			break;
 		default:
-			fprintf(stderr, "unk %d len %d\n", msg->type, msg->len);
+			fprintf(stderr, "unk %d len %zu\n", hdr.type, hdr.len);
 			return -1;
 		}
-
-		free(msg);
 	}
 
 	return 0;
@@ -597,14 +1385,13 @@ int main(int argc, char **argv)
 	const char *server_binary = "cdba-server";
 	int timeout_inactivity = 0;
 	int timeout_total = 600;
-	struct work *next;
-	struct work *work;
-	struct circ_buf recv_buf = { 0 };
+	struct circ_buf recv_buf;
 	const char *board = NULL;
 	const char *host = NULL;
 	struct timeval now;
 	struct timeval tv;
 	int power_cycles = 0;
+	bool expired;
 	struct stat sb;
 	int ssh_fds[3];
 	char buf[128];
@@ -684,7 +1471,12 @@ int main(int argc, char **argv)
 	if (ret)
 		err(1, "failed to connect to \"%s\"", host);
 
+	ret = circ_init(&recv_buf, CIRC_BUF_SIZE, true);
+	if (ret < 0)
+		errx(1, "failed to allocate receive buffer");
+
 	orig_tios = tty_unbuffer();
+	tty_attached = orig_tios != NULL;
 
 	timeout_total_tv = get_timeout(timeout_total);
 	timeout_inactivity_tv = get_timeout(timeout_inactivity);
@@ -715,14 +1507,15 @@ int main(int argc, char **argv)
 		FD_SET(ssh_fds[2], &rfds);
 		nfds = MAX(ssh_fds[1], ssh_fds[2]);
 
-		if (orig_tios) {
+		if (orig_tios && !select_pending) {
 			FD_SET(STDIN_FILENO, &rfds);
 
 			nfds = MAX(nfds, STDIN_FILENO);
 		}
 
+		/* Hold back other requests until the protocol is agreed upon */
 		FD_ZERO(&wfds);
-		if (!list_empty(&work_items))
+		if (ssh_pending() && !select_pending)
 			FD_SET(ssh_fds[0], &wfds);
 
 		gettimeofday(&now, NULL);
@@ -732,6 +1525,11 @@ int main(int argc, char **argv)
 			timersub(&timeout_total_tv, &now, &tv);
 		}
 
+		/* Only poll while the image is being processed, or past the deadline */
+		expired = tv.tv_sec < 0 || !timerisset(&tv);
+		if (fastboot_hashing || fastboot_scanning || expired)
+			timerclear(&tv);
+
 		ret = select(nfds + 1, &rfds, &wfds, NULL, &tv);
 #if 0
 		printf("select: %d (%c%c%c)\n", ret, FD_ISSET(STDIN_FILENO, &rfds) ? 'X' : '-',
@@ -740,7 +1538,8 @@ int main(int argc, char **argv)
 #endif
 		if (ret < 0) {
 			err(1, "select");
-		} else if (ret == 0) {
+		} else if (ret == 0 &&
+			   ((!fastboot_hashing && !fastboot_scanning) || expired)) {
 			if (timeout_inactivity && timercmp(&timeout_inactivity_tv, &timeout_total_tv, <))
 				warnx("timeout due to inactivity");
 			else
@@ -749,6 +1548,11 @@ int main(int argc, char **argv)
 			reached_timeout = true;
 		}
 
+		if (fastboot_hashing)
+			fastboot_hash_step();
+		else if (fastboot_scanning)
+			fastboot_delta_step();
+
 		if (FD_ISSET(STDIN_FILENO, &rfds))
 			tty_callback(ssh_fds);
 
@@ -788,19 +1592,16 @@ int main(int argc, char **argv)
 				timeout_inactivity_tv = get_timeout(timeout_inactivity);
 		}
 
-		if (FD_ISSET(ssh_fds[0], &wfds)) {
-			list_for_each_entry_safe(work, next, &work_items, node) {
-				list_del(&work->node);
-
-				work->fn(work, ssh_fds[0]);
-			}
-		}
+		if (FD_ISSET(ssh_fds[0], &wfds))
+			ssh_schedule(ssh_fds[0]);
 	}
 
 	close(ssh_fds[0]);
 	close(ssh_fds[1]);
 	close(ssh_fds[2]);
 
+	circ_destroy(&recv_buf);
+
 	if (verb == CDBA_BOOT)
 		printf("Waiting for ssh to finish\n");
 
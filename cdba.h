@@ -8,12 +8,40 @@
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 
+/* Protocol version 1 frame, with a host endian length */
 struct msg {
 	uint8_t type;
 	uint16_t len;
 	uint8_t data[];
 } __packed;
 
+/* Protocol version 2 frame, with a little endian length */
+struct msg_v2 {
+	uint8_t type;
+	uint32_t len;
+	uint8_t data[];
+} __packed;
+
+#define CDBA_PROTOCOL_V1	1
+#define CDBA_PROTOCOL_V2	2
+
+/* Largest frame payload a version 2 peer accepts */
+#define MSG_V2_LEN_MAX		(128 * 1024)
+
+/* Payload size of bulk transfer frames, such as image uploads */
+#define MSG_V1_BULK_LEN		2048
+#define MSG_V2_BULK_LEN		(64 * 1024)
+
+/*
+ * Appended after the board name in MSG_SELECT_BOARD by version 2 clients, and
+ * sent as the MSG_SELECT_BOARD reply by version 2 servers. Both sides switch
+ * to the agreed version for all frames following the reply.
+ */
+struct msg_hello {
+	uint8_t version;
+	uint32_t len_max;
+} __packed;
+
 enum {
 	MSG_SELECT_BOARD = 1,
 	MSG_CONSOLE,
@@ -30,6 +58,18 @@ enum {
 	MSG_SEND_BREAK,
 	MSG_LIST_DEVICES,
 	MSG_BOARD_INFO,
+	MSG_FASTBOOT_DOWNLOAD_SIZE,
+	MSG_FASTBOOT_DIGEST,
+	MSG_FASTBOOT_DELTA_SIGNATURE,
+	MSG_FASTBOOT_DELTA,
+	MSG_FASTBOOT_CREDIT,
+};
+
+/* Server response to MSG_FASTBOOT_DIGEST */
+enum {
+	FASTBOOT_DIGEST_MISS,
+	FASTBOOT_DIGEST_HIT,
+	FASTBOOT_DIGEST_DELTA,
 };
 
 #endif
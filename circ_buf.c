@@ -28,14 +28,172 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#define _GNU_SOURCE
+#include <sys/mman.h>
 
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "circ_buf.h"
 
+static int circ_map_mirror(struct circ_buf *circ, size_t size)
+{
+	void *base;
+	void *p;
+	int fd;
+
+	if (size % sysconf(_SC_PAGESIZE))
+		return -1;
+
+	fd = memfd_create("cdba-circ", MFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate(fd, size) < 0)
+		goto err_close;
+
+	/* Reserve room for both views, then map the buffer into each half */
+	base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		goto err_close;
+
+	p = mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+	if (p == MAP_FAILED)
+		goto err_unmap;
+
+	p = mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+	if (p == MAP_FAILED)
+		goto err_unmap;
+
+	close(fd);
+
+	circ->buf = base;
+	circ->mirrored = true;
+
+	return 0;
+
+err_unmap:
+	munmap(base, 2 * size);
+err_close:
+	close(fd);
+
+	return -1;
+}
+
+/**
+ * circ_init() - allocate storage for a circular buffer
+ * @circ:	circ_buf object to initialize
+ * @size:	capacity in bytes, must be a power of two
+ * @mirror:	attempt to map the storage twice, so that all data is contiguous
+ *
+ * A ring holds at most @size - 1 bytes. When the mirrored mapping can't be
+ * set up, e.g. because @size isn't a multiple of the page size, a regular
+ * buffer is used instead.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int circ_init(struct circ_buf *circ, size_t size, bool mirror)
+{
+	if (!size || size & (size - 1))
+		return -EINVAL;
+
+	memset(circ, 0, sizeof(*circ));
+	circ->size = size;
+
+	if (mirror && !circ_map_mirror(circ, size))
+		return 0;
+
+	circ->buf = malloc(size);
+	if (!circ->buf)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void circ_destroy(struct circ_buf *circ)
+{
+	if (circ->mirrored)
+		munmap(circ->buf, 2 * circ->size);
+	else
+		free(circ->buf);
+
+	circ->buf = NULL;
+}
+
+/**
+ * circ_data_iov() - describe buffered data as contiguous regions
+ * @circ:	circ_buf object
+ * @offset:	offset from the tail of the first byte to describe
+ * @len:	number of bytes to describe
+ * @iov:	array of at least two entries, filled with the regions
+ *
+ * Return: number of entries used, or 0 if fewer than @offset + @len bytes are
+ * available. A mirrored ring always uses a single entry.
+ */
+int circ_data_iov(struct circ_buf *circ, size_t offset, size_t len, struct iovec *iov)
+{
+	size_t start;
+	size_t first;
+
+	if (CIRC_AVAIL(circ) < offset + len)
+		return 0;
+
+	start = (circ->tail + offset) & (circ->size - 1);
+	if (circ->mirrored)
+		first = len;
+	else
+		first = MIN(len, circ->size - start);
+
+	iov[0].iov_base = circ->buf + start;
+	iov[0].iov_len = first;
+	if (first == len)
+		return 1;
+
+	iov[1].iov_base = circ->buf;
+	iov[1].iov_len = len - first;
+
+	return 2;
+}
+
+/**
+ * circ_space_iov() - describe free space as contiguous regions
+ * @circ:	circ_buf object
+ * @iov:	array of at least two entries, filled with the regions
+ *
+ * Return: number of entries used, 0 if the buffer is full
+ */
+int circ_space_iov(struct circ_buf *circ, struct iovec *iov)
+{
+	size_t space = CIRC_SPACE(circ);
+	size_t first;
+
+	if (!space)
+		return 0;
+
+	if (circ->mirrored)
+		first = space;
+	else
+		first = MIN(space, circ->size - circ->head);
+
+	iov[0].iov_base = circ->buf + circ->head;
+	iov[0].iov_len = first;
+	if (first == space)
+		return 1;
+
+	iov[1].iov_base = circ->buf;
+	iov[1].iov_len = space - first;
+
+	return 2;
+}
+
+void circ_consume(struct circ_buf *circ, size_t len)
+{
+	circ->tail = (circ->tail + len) & (circ->size - 1);
+}
+
 /**
  * circ_fill() - read data into circular buffer
  * @fd:		non-blocking file descriptor to read
@@ -45,61 +203,87 @@
  */
 ssize_t circ_fill(int fd, struct circ_buf *circ)
 {
+	struct iovec iov[2];
 	size_t space;
-	size_t count = 0;
-	ssize_t n = 0;
+	ssize_t n;
+	int count;
 
 	do {
-		space = CIRC_SPACE_TO_END(circ);
-		if (!space) {
+		count = circ_space_iov(circ, iov);
+		if (!count) {
 			errno = EAGAIN;
 			return -1;
 		}
 
-		n = read(fd, circ->buf + circ->head, space);
+		space = iov[0].iov_len + (count > 1 ? iov[1].iov_len : 0);
+
+		n = readv(fd, iov, count);
 		if (n == 0) {
 			errno = EPIPE;
 			return -1;
 		} else if (n < 0)
 			return -1;
 
-		count += n;
-
-		circ->head = (circ->head + n) & (CIRC_BUF_SIZE - 1);
-	} while (n != space);
+		circ->head = (circ->head + n) & (circ->size - 1);
+	} while (n == space);
 
 	return 0;
 }
 
-size_t circ_peak(struct circ_buf *circ, void *buf, size_t len)
+static size_t circ_copy(struct circ_buf *circ, void *buf, size_t len)
 {
-	size_t tail = circ->tail;
-	char *p = buf;
+	struct iovec iov[2];
+	int count;
 
-	while (len--) {
-		if (tail == circ->head)
-			return 0;
+	count = circ_data_iov(circ, 0, len, iov);
+	if (!count)
+		return 0;
 
-		*p++ = circ->buf[tail];
+	memcpy(buf, iov[0].iov_base, iov[0].iov_len);
+	if (count > 1)
+		memcpy(buf + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
 
-		tail = (tail + 1) & (CIRC_BUF_SIZE - 1);
-	}
+	return len;
+}
 
-	return (void*)p - buf;
+size_t circ_peak(struct circ_buf *circ, void *buf, size_t len)
+{
+	return circ_copy(circ, buf, len);
 }
 
 size_t circ_read(struct circ_buf *circ, void *buf, size_t len)
 {
-	char *p = buf;
+	len = circ_copy(circ, buf, len);
+	circ_consume(circ, len);
+
+	return len;
+}
+
+/**
+ * circ_write() - append data to circular buffer
+ * @circ:	circ_buf object to write to
+ * @buf:	data to append
+ * @len:	number of bytes in @buf
+ *
+ * Return: @len, or 0 if there's not enough space for all of @buf
+ */
+size_t circ_write(struct circ_buf *circ, const void *buf, size_t len)
+{
+	struct iovec iov[2];
+	int count;
+
+	if (CIRC_SPACE(circ) < len)
+		return 0;
 
-	while (len--) {
-		if (circ->tail == circ->head)
-			return 0;
+	count = circ_space_iov(circ, iov);
+	if (!count)
+		return 0;
 
-		*p++ = circ->buf[circ->tail];
+	memcpy(iov[0].iov_base, buf, MIN(len, iov[0].iov_len));
+	if (count > 1 && len > iov[0].iov_len)
+		memcpy(iov[1].iov_base, buf + iov[0].iov_len, len - iov[0].iov_len);
 
-		circ->tail = (circ->tail + 1) & (CIRC_BUF_SIZE - 1);
-	}
+	circ->head = (circ->head + len) & (circ->size - 1);
 
-	return (void*)p - buf;
+	return len;
 }
@@ -31,27 +31,41 @@
 #ifndef __CIRC_BUF_H__
 #define __CIRC_BUF_H__
 
+#include <stdbool.h>
 #include <stdlib.h>
+#include <sys/uio.h>
 
 #ifndef MIN
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 #endif
 
-#define CIRC_BUF_SIZE 16384
+#define CIRC_BUF_SIZE (256 * 1024)
 
+/*
+ * A mirrored ring maps its storage twice, back to back, so that any region
+ * of up to @size bytes starting within the ring is contiguous in memory.
+ */
 struct circ_buf {
-	char buf[CIRC_BUF_SIZE];
+	char *buf;
+	size_t size;
 	size_t head;
 	size_t tail;
+	bool mirrored;
 };
 
-#define CIRC_AVAIL(circ) (((circ)->head - (circ)->tail) & (CIRC_BUF_SIZE - 1))
-#define CIRC_SPACE(circ) (((circ)->tail - (circ)->head - 1) & (CIRC_BUF_SIZE - 1))
+#define CIRC_AVAIL(circ) (((circ)->head - (circ)->tail) & ((circ)->size - 1))
+#define CIRC_SPACE(circ) (((circ)->tail - (circ)->head - 1) & ((circ)->size - 1))
 
-#define CIRC_SPACE_TO_END(circ) MIN(CIRC_SPACE(circ), CIRC_BUF_SIZE - (circ)->head)
+int circ_init(struct circ_buf *circ, size_t size, bool mirror);
+void circ_destroy(struct circ_buf *circ);
 
 ssize_t circ_fill(int fd, struct circ_buf *circ);
 size_t circ_peak(struct circ_buf *circ, void *buf, size_t len);
 size_t circ_read(struct circ_buf *circ, void *buf, size_t len);
+size_t circ_write(struct circ_buf *circ, const void *buf, size_t len);
+
+int circ_data_iov(struct circ_buf *circ, size_t offset, size_t len, struct iovec *iov);
+int circ_space_iov(struct circ_buf *circ, struct iovec *iov);
+void circ_consume(struct circ_buf *circ, size_t len);
 
 #endif
@@ -0,0 +1,550 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "config_cache.h"
+
+/*
+ * The parsed device configuration is kept in a binary cache, next to the
+ * image cache, so that sessions don't need to parse the YAML. The cache holds
+ * the key/value pairs of each board, in the order of the configuration file,
+ * and an open addressing hash table over the board names. It's tied to the
+ * configuration file it was compiled from by device, inode, size and
+ * modification time, and is rebuilt when any of these change.
+ *
+ * Layout, in host byte order:
+ *   struct config_cache_hdr
+ *   uint32_t buckets[bucket_count]	board index + 1, or 0 if empty
+ *   struct config_cache_board boards[board_count]
+ *   struct config_cache_pair pairs[pair_count]
+ *   char strings[strings_size]		NUL terminated strings
+ */
+
+#define CONFIG_CACHE_MAGIC	"CDBACFG"
+#define CONFIG_CACHE_VERSION	1
+#define CONFIG_CACHE_NAME	"config"
+
+struct config_cache_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t board_count;
+	uint32_t bucket_count;
+	uint32_t pair_count;
+	uint32_t strings_size;
+	uint32_t source;
+
+	uint64_t src_dev;
+	uint64_t src_ino;
+	uint64_t src_size;
+	int64_t src_mtime_sec;
+	int64_t src_mtime_nsec;
+};
+
+struct config_cache_board {
+	uint32_t name;
+	uint32_t hash;
+	uint32_t pair;
+	uint32_t pair_count;
+};
+
+struct config_cache_pair {
+	uint32_t key;
+	uint32_t value;
+};
+
+/* The active cache, mapped from file or compiled in memory */
+static const void *cache_base;
+static size_t cache_size;
+static bool cache_mapped;
+
+static const struct config_cache_hdr *cache_hdr;
+static const uint32_t *cache_buckets;
+static const struct config_cache_board *cache_boards;
+static const struct config_cache_pair *cache_pairs;
+static const char *cache_strings;
+
+/* Cache being compiled */
+static struct config_cache_board *build_boards;
+static struct config_cache_pair *build_pairs;
+static char *build_strings;
+static size_t build_board_count;
+static size_t build_pair_count;
+static size_t build_strings_size;
+
+static uint32_t config_cache_hash(const char *s, size_t len)
+{
+	uint32_t hash = 2166136261u;
+
+	while (len--) {
+		hash ^= (uint8_t)*s++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static void config_cache_install(const void *base, size_t size, bool mapped)
+{
+	const struct config_cache_hdr *hdr = base;
+
+	if (cache_base) {
+		if (cache_mapped)
+			munmap((void *)cache_base, cache_size);
+		else
+			free((void *)cache_base);
+	}
+
+	cache_base = base;
+	cache_size = size;
+	cache_mapped = mapped;
+
+	cache_hdr = hdr;
+	cache_buckets = (const uint32_t *)(hdr + 1);
+	cache_boards = (const struct config_cache_board *)(cache_buckets + hdr->bucket_count);
+	cache_pairs = (const struct config_cache_pair *)(cache_boards + hdr->board_count);
+	cache_strings = (const char *)(cache_pairs + hdr->pair_count);
+}
+
+static size_t config_cache_layout(const struct config_cache_hdr *hdr)
+{
+	return sizeof(*hdr) +
+	       (size_t)hdr->bucket_count * sizeof(uint32_t) +
+	       (size_t)hdr->board_count * sizeof(struct config_cache_board) +
+	       (size_t)hdr->pair_count * sizeof(struct config_cache_pair) +
+	       hdr->strings_size;
+}
+
+/* Reject caches that are truncated, corrupt or from a different version */
+static bool config_cache_valid(const void *base, size_t size)
+{
+	const struct config_cache_hdr *hdr = base;
+	const struct config_cache_board *boards;
+	const struct config_cache_pair *pairs;
+	const uint32_t *buckets;
+	const char *strings;
+	uint32_t i;
+
+	if (size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, CONFIG_CACHE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != CONFIG_CACHE_VERSION ||
+	    !hdr->bucket_count || hdr->bucket_count & (hdr->bucket_count - 1) ||
+	    hdr->bucket_count <= hdr->board_count ||
+	    !hdr->strings_size ||
+	    config_cache_layout(hdr) != size)
+		return false;
+
+	buckets = (const uint32_t *)(hdr + 1);
+	boards = (const struct config_cache_board *)(buckets + hdr->bucket_count);
+	pairs = (const struct config_cache_pair *)(boards + hdr->board_count);
+	strings = (const char *)(pairs + hdr->pair_count);
+
+	if (strings[hdr->strings_size - 1] != '\0' || hdr->source >= hdr->strings_size)
+		return false;
+
+	for (i = 0; i < hdr->bucket_count; i++) {
+		if (buckets[i] > hdr->board_count)
+			return false;
+	}
+
+	for (i = 0; i < hdr->board_count; i++) {
+		if (boards[i].name >= hdr->strings_size ||
+		    boards[i].pair > hdr->pair_count ||
+		    boards[i].pair_count > hdr->pair_count - boards[i].pair)
+			return false;
+	}
+
+	for (i = 0; i < hdr->pair_count; i++) {
+		if (pairs[i].key >= hdr->strings_size ||
+		    pairs[i].value >= hdr->strings_size)
+			return false;
+	}
+
+	return true;
+}
+
+static int config_cache_path(char *path, size_t len)
+{
+	const char *dir = cache_dir();
+	int n;
+
+	if (!dir)
+		return -ENOENT;
+
+	n = snprintf(path, len, "%s/%s", dir, CONFIG_CACHE_NAME);
+	if (n >= len)
+		return -ENAMETOOLONG;
+
+	return 0;
+}
+
+/**
+ * config_cache_load() - use the cached configuration, if it's up to date
+ * @source:	path of the configuration file
+ *
+ * Return: 0 if a cache matching @source was loaded, negative errno otherwise
+ */
+int config_cache_load(const char *source)
+{
+	const struct config_cache_hdr *hdr;
+	char resolved[PATH_MAX];
+	char path[PATH_MAX];
+	struct stat src;
+	struct stat sb;
+	void *base;
+	int ret;
+	int fd;
+
+	if (!realpath(source, resolved) || stat(resolved, &src) < 0)
+		return -errno;
+
+	ret = config_cache_path(path, sizeof(path));
+	if (ret < 0)
+		return ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &sb) < 0 || !sb.st_size) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return -errno;
+
+	hdr = base;
+	if (!config_cache_valid(base, sb.st_size))
+		goto stale;
+
+	if (hdr->src_dev != src.st_dev || hdr->src_ino != src.st_ino ||
+	    hdr->src_size != src.st_size ||
+	    hdr->src_mtime_sec != src.st_mtim.tv_sec ||
+	    hdr->src_mtime_nsec != src.st_mtim.tv_nsec)
+		goto stale;
+
+	if (strcmp((const char *)base + sb.st_size - hdr->strings_size + hdr->source, resolved))
+		goto stale;
+
+	config_cache_install(base, sb.st_size, true);
+
+	return 0;
+
+stale:
+	munmap(base, sb.st_size);
+	return -ESTALE;
+}
+
+static uint32_t config_cache_build_string(const char *s)
+{
+	size_t len = strlen(s) + 1;
+	uint32_t offset = build_strings_size;
+
+	build_strings = realloc(build_strings, build_strings_size + len);
+	if (!build_strings)
+		err(1, "failed to allocate config cache");
+
+	memcpy(build_strings + offset, s, len);
+	build_strings_size += len;
+
+	return offset;
+}
+
+/**
+ * config_cache_build_begin() - start compiling a new cache
+ */
+void config_cache_build_begin(void)
+{
+	free(build_boards);
+	free(build_pairs);
+	free(build_strings);
+
+	build_boards = NULL;
+	build_pairs = NULL;
+	build_strings = NULL;
+	build_board_count = 0;
+	build_pair_count = 0;
+	build_strings_size = 0;
+
+	/* Offset 0 is the empty string, for boards without a name */
+	config_cache_build_string("");
+}
+
+/**
+ * config_cache_build_board() - start a new board in the cache being compiled
+ */
+void config_cache_build_board(void)
+{
+	struct config_cache_board *board;
+
+	build_boards = realloc(build_boards, (build_board_count + 1) * sizeof(*build_boards));
+	if (!build_boards)
+		err(1, "failed to allocate config cache");
+
+	board = &build_boards[build_board_count++];
+	memset(board, 0, sizeof(*board));
+	board->pair = build_pair_count;
+}
+
+/**
+ * config_cache_build_pair() - add a key/value pair to the current board
+ * @key:	configuration key
+ * @value:	configuration value
+ */
+void config_cache_build_pair(const char *key, const char *value)
+{
+	struct config_cache_board *board = &build_boards[build_board_count - 1];
+	struct config_cache_pair *pair;
+
+	build_pairs = realloc(build_pairs, (build_pair_count + 1) * sizeof(*build_pairs));
+	if (!build_pairs)
+		err(1, "failed to allocate config cache");
+
+	pair = &build_pairs[build_pair_count++];
+	pair->key = config_cache_build_string(key);
+	pair->value = config_cache_build_string(value);
+
+	board->pair_count++;
+
+	if (!strcmp(key, "board") && !board->name) {
+		board->name = pair->value;
+		board->hash = config_cache_hash(value, strlen(value));
+	}
+}
+
+/**
+ * config_cache_save() - write the active cache to disk, for later sessions
+ */
+void config_cache_save(void)
+{
+	const void *base = cache_base;
+	size_t size = cache_size;
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	ssize_t n;
+	int fd;
+
+	if (!cache_hdr || cache_mapped || !cache_strings[cache_hdr->source])
+		return;
+
+	if (config_cache_path(path, sizeof(path)) < 0)
+		return;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= sizeof(tmp))
+		return;
+
+	fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	while (size) {
+		n = write(fd, base, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0)
+			goto err;
+
+		base += n;
+		size -= n;
+	}
+
+	close(fd);
+
+	if (rename(tmp, path) < 0)
+		unlink(tmp);
+
+	return;
+
+err:
+	close(fd);
+	unlink(tmp);
+}
+
+/**
+ * config_cache_build_end() - finish compiling the cache and make it active
+ * @source:	path of the configuration file the cache was compiled from
+ */
+void config_cache_build_end(const char *source)
+{
+	struct config_cache_hdr *hdr;
+	char resolved[PATH_MAX];
+	struct stat src = {};
+	uint32_t *buckets;
+	uint32_t bucket;
+	uint32_t count;
+	size_t size;
+	void *base;
+	size_t i;
+	bool dup;
+
+	if (!realpath(source, resolved) || stat(resolved, &src) < 0)
+		strcpy(resolved, "");
+
+	hdr = calloc(1, sizeof(*hdr));
+	if (!hdr)
+		err(1, "failed to allocate config cache");
+
+	memcpy(hdr->magic, CONFIG_CACHE_MAGIC, sizeof(hdr->magic));
+	hdr->version = CONFIG_CACHE_VERSION;
+	hdr->board_count = build_board_count;
+	hdr->pair_count = build_pair_count;
+	hdr->source = config_cache_build_string(resolved);
+	hdr->strings_size = build_strings_size;
+	hdr->src_dev = src.st_dev;
+	hdr->src_ino = src.st_ino;
+	hdr->src_size = src.st_size;
+	hdr->src_mtime_sec = src.st_mtim.tv_sec;
+	hdr->src_mtime_nsec = src.st_mtim.tv_nsec;
+
+	/* Keep the table at most half full */
+	for (count = 16; count < 2 * build_board_count; count *= 2)
+		;
+	hdr->bucket_count = count;
+
+	size = config_cache_layout(hdr);
+	base = calloc(1, size);
+	if (!base)
+		err(1, "failed to allocate config cache");
+
+	memcpy(base, hdr, sizeof(*hdr));
+	buckets = base + sizeof(*hdr);
+	memcpy(buckets + count, build_boards, build_board_count * sizeof(*build_boards));
+	memcpy((void *)(buckets + count) + build_board_count * sizeof(*build_boards),
+	       build_pairs, build_pair_count * sizeof(*build_pairs));
+	memcpy(base + size - build_strings_size, build_strings, build_strings_size);
+
+	/* The first board of a given name wins, as in the configuration */
+	for (i = 0; i < build_board_count; i++) {
+		bucket = build_boards[i].hash & (count - 1);
+		dup = false;
+
+		while (buckets[bucket]) {
+			if (!strcmp(build_strings + build_boards[buckets[bucket] - 1].name,
+				    build_strings + build_boards[i].name)) {
+				dup = true;
+				break;
+			}
+
+			bucket = (bucket + 1) & (count - 1);
+		}
+
+		if (!dup)
+			buckets[bucket] = i + 1;
+	}
+
+	free(hdr);
+
+	config_cache_install(base, size, false);
+
+	config_cache_build_begin();
+}
+
+/**
+ * config_cache_boards() - number of boards in the active cache
+ */
+unsigned int config_cache_boards(void)
+{
+	return cache_hdr ? cache_hdr->board_count : 0;
+}
+
+/**
+ * config_cache_lookup() - find a board by name
+ * @board:	board name, not necessarily NUL terminated
+ * @len:	length of @board
+ *
+ * Return: index of the board, or -1 if not found
+ */
+int config_cache_lookup(const char *board, size_t len)
+{
+	const struct config_cache_board *entry;
+	uint32_t bucket;
+	uint32_t hash;
+	const char *name;
+
+	if (!cache_hdr)
+		return -1;
+
+	hash = config_cache_hash(board, len);
+	bucket = hash & (cache_hdr->bucket_count - 1);
+
+	while (cache_buckets[bucket]) {
+		entry = &cache_boards[cache_buckets[bucket] - 1];
+		name = cache_strings + entry->name;
+
+		if (entry->hash == hash && !strncmp(name, board, len) && !name[len])
+			return cache_buckets[bucket] - 1;
+
+		bucket = (bucket + 1) & (cache_hdr->bucket_count - 1);
+	}
+
+	return -1;
+}
+
+/**
+ * config_cache_pairs() - number of key/value pairs of a board
+ * @board:	index of the board
+ */
+unsigned int config_cache_pairs(unsigned int board)
+{
+	return cache_boards[board].pair_count;
+}
+
+/**
+ * config_cache_pair() - retrieve a key/value pair of a board
+ * @board:	index of the board
+ * @pair:	index of the pair, within the board
+ * @key:	set to the configuration key
+ * @value:	set to the configuration value
+ */
+void config_cache_pair(unsigned int board, unsigned int pair,
+		       const char **key, const char **value)
+{
+	const struct config_cache_pair *p = &cache_pairs[cache_boards[board].pair + pair];
+
+	*key = cache_strings + p->key;
+	*value = cache_strings + p->value;
+}
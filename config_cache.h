@@ -0,0 +1,20 @@
+#ifndef __CONFIG_CACHE_H__
+#define __CONFIG_CACHE_H__
+
+#include <stddef.h>
+
+int config_cache_load(const char *source);
+
+void config_cache_build_begin(void);
+void config_cache_build_board(void);
+void config_cache_build_pair(const char *key, const char *value);
+void config_cache_build_end(const char *source);
+void config_cache_save(void);
+
+unsigned int config_cache_boards(void);
+int config_cache_lookup(const char *board, size_t len);
+unsigned int config_cache_pairs(unsigned int board);
+void config_cache_pair(unsigned int board, unsigned int pair,
+		       const char **key, const char **value);
+
+#endif
@@ -42,6 +42,7 @@
 
 #include "cdba-server.h"
 #include "conmux.h"
+#include "console.h"
 
 extern int h_errno;
 
@@ -207,8 +208,8 @@ out:
 
 static int conmux_data(int fd, void *data)
 {
-	struct msg hdr;
-	char buf[128];
+	struct device *dev = data;
+	char buf[4096];
 	ssize_t n;
 
 	n = read(fd, buf, sizeof(buf));
@@ -219,10 +220,7 @@ static int conmux_data(int fd, void *data)
 		fprintf(stderr, "Received EOF from conmux\n");
 		watch_quit();
 	} else {
-		hdr.type = MSG_CONSOLE;
-		hdr.len = n;
-		write(STDOUT_FILENO, &hdr, sizeof(hdr));
-		write(STDOUT_FILENO, buf, n);
+		console_output(dev, buf, n);
 	}
 
 	return 0;
@@ -293,7 +291,7 @@ void *conmux_open(struct device *dev)
 	conmux = calloc(1, sizeof(*conmux));
 	conmux->fd = fd;
 
-	watch_add_readfd(conmux->fd, conmux_data, NULL);
+	watch_add_readfd(conmux->fd, conmux_data, dev);
 
 	return conmux;
 }
@@ -29,39 +29,358 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "cdba-server.h"
+#include "console.h"
 #include "device.h"
 
+#define CONSOLE_READ_SIZE	4096
+
+/* Output within this long after console input is treated as echo */
+#define CONSOLE_ECHO_MS		100
+
+static bool console_echo(struct device *device)
+{
+	struct timespec now;
+	long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	ms = (now.tv_sec - device->console_input.tv_sec) * 1000 +
+	     (now.tv_nsec - device->console_input.tv_nsec) / 1000000;
+
+	return ms < CONSOLE_ECHO_MS;
+}
+
+/**
+ * console_output_flush() - send coalesced console output to the client
+ * @device:	device the output originates from
+ */
+void console_output_flush(struct device *device)
+{
+	watch_timer_cancel(device->console_batch_timer);
+	device->console_batch_timer = NULL;
+
+	if (!device->console_batch_len)
+		return;
+
+	cdba_send(MSG_CONSOLE, device->console_batch, device->console_batch_len);
+	device->console_batch_len = 0;
+}
+
+static void console_batch_expired(void *data)
+{
+	struct device *device = data;
+
+	device->console_batch_timer = NULL;
+
+	console_output_flush(device);
+}
+
+/**
+ * console_output() - forward console output to the client
+ * @device:	device the output originates from
+ * @buf:	console output
+ * @len:	number of bytes in @buf
+ *
+ * Output is coalesced into MSG_CONSOLE frames of up to console_batch_size
+ * bytes, which are sent when full or console_batch_ms after the first byte
+ * was buffered. Output following shortly after console input is sent right
+ * away, to keep interactive echo snappy.
+ */
+void console_output(struct device *device, const void *buf, size_t len)
+{
+	size_t size = device->console_batch_size;
+	size_t n;
+
+	if (!device->console_batch) {
+		device->console_batch = malloc(size);
+		if (!device->console_batch)
+			err(1, "failed to allocate console buffer");
+	}
+
+	while (len) {
+		n = MIN(len, size - device->console_batch_len);
+		memcpy(device->console_batch + device->console_batch_len, buf, n);
+		device->console_batch_len += n;
+
+		if (device->console_batch_len == size)
+			console_output_flush(device);
+
+		buf += n;
+		len -= n;
+	}
+
+	if (!device->console_batch_len)
+		return;
+
+	if (!device->console_batch_ms || console_echo(device)) {
+		console_output_flush(device);
+		return;
+	}
+
+	if (!device->console_batch_timer)
+		device->console_batch_timer = watch_timer_add(device->console_batch_ms,
+							      console_batch_expired,
+							      device);
+}
+
 static int console_data(int fd, void *data)
 {
-	struct msg hdr;
-	char buf[128];
+	struct device *device = data;
+	char buf[CONSOLE_READ_SIZE];
 	ssize_t n;
 
 	n = read(fd, buf, sizeof(buf));
 	if (n < 0)
 		return n;
 
-	hdr.type = MSG_CONSOLE;
-	hdr.len = n;
-	write(STDOUT_FILENO, &hdr, sizeof(hdr));
-	write(STDOUT_FILENO, buf, n);
+	console_output(device, buf, n);
 
 	return 0;
 }
 
+/*
+ * The optional capture thread reads the console tty into a single producer,
+ * single consumer ring, so that the serial port is drained even while the
+ * main loop is busy. head and tail are free running counters, written only
+ * by the capture thread and the main loop respectively.
+ */
+#define CONSOLE_CAPTURE_SIZE	(256 * 1024)
+
+struct console_capture {
+	struct device *device;
+	pthread_t thread;
+
+	char *buf;
+	_Atomic size_t head;
+	_Atomic size_t tail;
+	_Atomic size_t dropped;
+	size_t reported;
+
+	int notify_fds[2];
+};
+
+static void *console_capture_worker(void *data)
+{
+	struct console_capture *capture = data;
+	size_t offset;
+	size_t space;
+	size_t head;
+	size_t tail;
+	ssize_t n;
+	char c = 0;
+
+	for (;;) {
+		head = atomic_load_explicit(&capture->head, memory_order_relaxed);
+		tail = atomic_load_explicit(&capture->tail, memory_order_acquire);
+
+		offset = head & (CONSOLE_CAPTURE_SIZE - 1);
+		space = MIN(CONSOLE_CAPTURE_SIZE - (head - tail),
+			    CONSOLE_CAPTURE_SIZE - offset);
+
+		/* Keep draining the tty when the main loop falls behind */
+		if (!space) {
+			char discard[CONSOLE_READ_SIZE];
+
+			n = read(capture->device->console_fd, discard, sizeof(discard));
+			if (n > 0)
+				atomic_fetch_add(&capture->dropped, n);
+		} else {
+			n = read(capture->device->console_fd, capture->buf + offset, space);
+			if (n > 0)
+				atomic_store_explicit(&capture->head, head + n,
+						      memory_order_release);
+		}
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n <= 0)
+			break;
+
+		/* A full pipe already has a wakeup pending */
+		if (write(capture->notify_fds[1], &c, 1) < 0 && errno != EAGAIN)
+			warn("failed to notify console capture");
+	}
+
+	return NULL;
+}
+
+static int console_capture_data(int fd, void *data)
+{
+	struct console_capture *capture = data;
+	char discard[64];
+	size_t dropped;
+	size_t offset;
+	size_t head;
+	size_t tail;
+	size_t n;
+
+	while (read(fd, discard, sizeof(discard)) > 0)
+		;
+
+	head = atomic_load_explicit(&capture->head, memory_order_acquire);
+	tail = atomic_load_explicit(&capture->tail, memory_order_relaxed);
+
+	while (tail != head) {
+		offset = tail & (CONSOLE_CAPTURE_SIZE - 1);
+		n = MIN(head - tail, CONSOLE_CAPTURE_SIZE - offset);
+
+		console_output(capture->device, capture->buf + offset, n);
+
+		tail += n;
+		atomic_store_explicit(&capture->tail, tail, memory_order_release);
+	}
+
+	dropped = atomic_load(&capture->dropped);
+	if (dropped != capture->reported) {
+		warnx("console capture overrun, %zu bytes lost", dropped - capture->reported);
+		capture->reported = dropped;
+	}
+
+	return 0;
+}
+
+static int console_capture_start(struct console_capture *capture, int priority)
+{
+	struct sched_param param = { .sched_priority = priority };
+	pthread_attr_t attr;
+	int ret;
+
+	pthread_attr_init(&attr);
+
+	if (priority) {
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+
+	ret = pthread_create(&capture->thread, &attr, console_capture_worker, capture);
+	pthread_attr_destroy(&attr);
+
+	return ret;
+}
+
+static void console_capture_open(struct device *device)
+{
+	struct console_capture *capture;
+	struct termios tios;
+	int flags;
+	int ret;
+
+	capture = calloc(1, sizeof(*capture));
+	if (!capture)
+		err(1, "failed to allocate console capture");
+
+	capture->device = device;
+
+	/* Make reads block until data arrives, rather than return 0 */
+	if (tcgetattr(device->console_fd, &tios) == 0) {
+		tios.c_cc[VMIN] = 1;
+		tios.c_cc[VTIME] = 0;
+		tcsetattr(device->console_fd, TCSANOW, &tios);
+	}
+
+	capture->buf = mmap(NULL, CONSOLE_CAPTURE_SIZE, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (capture->buf == MAP_FAILED)
+		err(1, "failed to allocate console capture ring");
+
+	/* Avoid page faults in the capture path, if permitted */
+	if (mlock(capture->buf, CONSOLE_CAPTURE_SIZE) < 0)
+		warn("failed to lock console capture ring");
+
+	ret = pipe(capture->notify_fds);
+	if (ret < 0)
+		err(1, "failed to create console capture pipe");
+
+	flags = fcntl(capture->notify_fds[0], F_GETFL, 0);
+	fcntl(capture->notify_fds[0], F_SETFL, flags | O_NONBLOCK);
+	flags = fcntl(capture->notify_fds[1], F_GETFL, 0);
+	fcntl(capture->notify_fds[1], F_SETFL, flags | O_NONBLOCK);
+
+	watch_add_readfd(capture->notify_fds[0], console_capture_data, capture);
+
+	ret = console_capture_start(capture, device->console_capture_priority);
+	if (ret == EPERM) {
+		warnx("not permitted to use SCHED_FIFO for console capture");
+		ret = console_capture_start(capture, 0);
+	}
+	if (ret) {
+		errno = ret;
+		err(1, "failed to create console capture thread");
+	}
+
+	device->console_capture = capture;
+}
+
+/*
+ * Stop the capture thread, which might be blocked reading the tty, and hand
+ * whatever it captured to the client before releasing the ring.
+ */
+static void console_capture_close(struct device *device)
+{
+	struct console_capture *capture = device->console_capture;
+
+	pthread_cancel(capture->thread);
+	pthread_join(capture->thread, NULL);
+
+	console_capture_data(capture->notify_fds[0], capture);
+
+	watch_del_readfd(capture->notify_fds[0]);
+	close(capture->notify_fds[0]);
+	close(capture->notify_fds[1]);
+
+	munlock(capture->buf, CONSOLE_CAPTURE_SIZE);
+	munmap(capture->buf, CONSOLE_CAPTURE_SIZE);
+
+	free(capture);
+	device->console_capture = NULL;
+}
+
 void console_open(struct device *device)
 {
 	device->console_fd = tty_open(device->console_dev, &device->console_tios);
 	if (device->console_fd < 0)
 		err(1, "failed to open %s", device->console_dev);
 
-	watch_add_readfd(device->console_fd, console_data, device);
+	if (device->console_capture_thread)
+		console_capture_open(device);
+	else
+		watch_add_readfd(device->console_fd, console_data, device);
+}
+
+/**
+ * console_close() - stop forwarding the console of @device
+ * @device:	device to close the console of
+ */
+void console_close(struct device *device)
+{
+	if (device->console_fd < 0)
+		return;
+
+	if (device->console_capture)
+		console_capture_close(device);
+	else
+		watch_del_readfd(device->console_fd);
+
+	console_output_flush(device);
+
+	close(device->console_fd);
+	device->console_fd = -1;
 }
 
 int console_write(struct device *device, const void *buf, size_t len)
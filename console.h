@@ -3,8 +3,17 @@
 
 #include "device.h"
 
+/* Default coalescing of console output, see console_output() */
+#define CONSOLE_BATCH_SIZE	4096
+#define CONSOLE_BATCH_SIZE_MAX	(32 * 1024)
+#define CONSOLE_BATCH_MS	2
+
 void console_open(struct device *device);
+void console_close(struct device *device);
 int console_write(struct device *device, const void *buf, size_t len);
 void console_send_break(struct device *device);
 
+void console_output(struct device *device, const void *buf, size_t len);
+void console_output_flush(struct device *device);
+
 #endif
@@ -0,0 +1,532 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config_cache.h"
+#include "daemon.h"
+#include "device_parser.h"
+#include "hotplug.h"
+
+/*
+ * A persistent cdba-server parses the configuration once and then serves each
+ * session from a forked child. cdba-server invoked for an ssh session hands its
+ * stdin, stdout and stderr over to the daemon, using SCM_RIGHTS, and stays
+ * around until the session has ended; the session's data never passes through
+ * the relay.
+ *
+ * The daemon also keeps the USB hotplug index for all sessions, each session
+ * subscribing to the serial number of its board over a socketpair.
+ *
+ * Changes to the configuration files are picked up using inotify, including
+ * one of higher precedence appearing or being removed. The updated
+ * configuration is parsed, and compiled into the configuration cache, by a
+ * short lived child, so that a broken configuration can't take the daemon
+ * down; the daemon then switches over to the new cache. Sessions in progress
+ * keep the configuration they were started with.
+ */
+
+#define DAEMON_SESSION_FDS	3
+
+enum {
+	DAEMON_POLL_LISTEN,
+	DAEMON_POLL_HOTPLUG,
+	DAEMON_POLL_CONFIG,
+	DAEMON_POLL_RELOAD,
+	DAEMON_POLL_SESSIONS,
+};
+
+/**
+ * daemon_socket_path() - path of the daemon's listening socket
+ *
+ * Return: $CDBA_SOCKET if set, otherwise $HOME/.cdba-server.sock
+ */
+const char *daemon_socket_path(void)
+{
+	static char path[PATH_MAX];
+	const char *home;
+	const char *env;
+
+	env = getenv("CDBA_SOCKET");
+	if (env)
+		return env;
+
+	home = getenv("HOME");
+	if (!home)
+		home = ".";
+
+	snprintf(path, sizeof(path), "%s/.cdba-server.sock", home);
+
+	return path;
+}
+
+static int daemon_addr(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		warnx("socket path \"%s\" too long", path);
+		return -1;
+	}
+
+	strcpy(addr->sun_path, path);
+
+	return 0;
+}
+
+/**
+ * daemon_relay() - hand the current session over to a running daemon
+ * @path:	path of the daemon's socket
+ *
+ * Return: -1 if no daemon is accepting sessions, otherwise doesn't return
+ */
+int daemon_relay(const char *path)
+{
+	int fds[DAEMON_SESSION_FDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	char control[CMSG_SPACE(sizeof(fds))] = {};
+	struct sockaddr_un addr;
+	struct cmsghdr *cmsg;
+	struct msghdr msg = {};
+	struct iovec iov;
+	char c = 0;
+	ssize_t n;
+	int fd;
+
+	if (daemon_addr(path, &addr) < 0)
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	n = sendmsg(fd, &msg, 0);
+	if (n < 0) {
+		close(fd);
+		return -1;
+	}
+
+	/* The session holds on to the connection until it ends */
+	do {
+		n = read(fd, &c, 1);
+	} while (n < 0 && errno == EINTR);
+
+	exit(0);
+}
+
+/* Receive the session's stdio from the relay and install it as our own */
+static int daemon_session_setup(int fd)
+{
+	char control[CMSG_SPACE(sizeof(int) * DAEMON_SESSION_FDS)];
+	int fds[DAEMON_SESSION_FDS];
+	struct cmsghdr *cmsg;
+	struct msghdr msg = {};
+	struct iovec iov;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	ssize_t n;
+	char c;
+	int i;
+
+	/* Only serve sessions of our own user */
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ||
+	    cred.uid != getuid()) {
+		warnx("rejecting session of uid %d", (int)cred.uid);
+		return -1;
+	}
+
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	if (n <= 0)
+		return -1;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+		warnx("malformed session request");
+		return -1;
+	}
+
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	for (i = 0; i < DAEMON_SESSION_FDS; i++) {
+		if (dup2(fds[i], i) < 0)
+			return -1;
+
+		close(fds[i]);
+	}
+
+	return 0;
+}
+
+/* inotify watch descriptors of the directories of the configuration files */
+static int daemon_config_wds[DEVICE_PARSER_CONFIGS];
+
+/*
+ * Watch the directories of all candidate configuration files, as files might
+ * be replaced, and one might appear or disappear and so change which is used.
+ */
+static int daemon_config_watch(void)
+{
+	char dir[PATH_MAX];
+	bool watched = false;
+	int fd;
+	int i;
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		warn("unable to watch configuration");
+		return -1;
+	}
+
+	for (i = 0; i < DEVICE_PARSER_CONFIGS; i++) {
+		strcpy(dir, device_parser_configs[i]);
+
+		daemon_config_wds[i] = inotify_add_watch(fd, dirname(dir),
+							 IN_CLOSE_WRITE | IN_MOVED_TO |
+							 IN_MOVED_FROM | IN_DELETE);
+		if (daemon_config_wds[i] < 0)
+			warn("unable to watch %s", device_parser_configs[i]);
+		else
+			watched = true;
+	}
+
+	if (!watched) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Return true if a configuration file was written, replaced or removed */
+static bool daemon_config_event(int fd)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	char name[PATH_MAX];
+	bool changed = false;
+	ssize_t n;
+	char *p;
+	int i;
+
+	for (;;) {
+		n = read(fd, buf, sizeof(buf));
+		if (n <= 0)
+			break;
+
+		for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (!ev->len)
+				continue;
+
+			for (i = 0; i < DEVICE_PARSER_CONFIGS; i++) {
+				strcpy(name, device_parser_configs[i]);
+
+				if (ev->wd == daemon_config_wds[i] &&
+				    !strcmp(ev->name, basename(name)))
+					changed = true;
+			}
+		}
+	}
+
+	return changed;
+}
+
+/*
+ * Parse the configuration in a child, which reports the index of the file it
+ * used over a pipe before exiting. Returns the read end of the pipe.
+ */
+static int daemon_reload_start(struct pollfd *pfds, nfds_t nfds)
+{
+	unsigned char c;
+	pid_t pid;
+	nfds_t i;
+	int p[2];
+	int ret;
+
+	if (pipe(p) < 0) {
+		warn("failed to reload configuration");
+		return -1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		warn("failed to reload configuration");
+		close(p[0]);
+		close(p[1]);
+		return -1;
+	} else if (pid > 0) {
+		close(p[1]);
+		fcntl(p[0], F_SETFD, FD_CLOEXEC);
+		return p[0];
+	}
+
+	for (i = 0; i < nfds; i++)
+		close(pfds[i].fd);
+	close(p[0]);
+
+	/* device_parser() exits on invalid configuration */
+	ret = device_parser_default();
+	if (ret < 0)
+		exit(1);
+
+	c = ret;
+
+	if (write(p[1], &c, 1) < 0)
+		exit(1);
+
+	exit(0);
+}
+
+static void daemon_reload_finish(int fd)
+{
+	const char *config;
+	unsigned char c;
+	ssize_t n;
+
+	do {
+		n = read(fd, &c, 1);
+	} while (n < 0 && errno == EINTR);
+
+	if (n != 1 || c >= DEVICE_PARSER_CONFIGS) {
+		warnx("invalid or missing configuration, keeping the previous one");
+		return;
+	}
+
+	/* Boards are only instantiated by sessions, so swapping the cache suffices */
+	config = device_parser_configs[c];
+	if (config_cache_load(config) < 0)
+		warnx("unable to load the updated configuration");
+	else
+		warnx("configuration reloaded from %s", config);
+}
+
+/**
+ * daemon_run() - accept sessions, serving each from a forked child
+ * @path:	path of the socket to listen on
+ *
+ * Return: only in a session child, once its stdio has been set up
+ */
+void daemon_run(const char *path)
+{
+	nfds_t pfds_alloc = DAEMON_POLL_SESSIONS + 16;
+	nfds_t nfds = DAEMON_POLL_SESSIONS;
+	struct sockaddr_un addr;
+	bool reload_pending = false;
+	struct pollfd *pfds;
+	mode_t mask;
+	pid_t pid;
+	int listen_fd;
+	nfds_t i;
+	int sv[2];
+	int ret;
+	int fd;
+
+	if (daemon_addr(path, &addr) < 0)
+		exit(1);
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0)
+		err(1, "failed to create daemon socket");
+
+	/* Replace a stale socket, but not one with a live daemon behind it */
+	if (connect(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+		errx(1, "daemon already running on %s", path);
+	unlink(path);
+
+	/* Only the owner may connect, without affecting the files of sessions */
+	mask = umask(077);
+	ret = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (ret < 0)
+		err(1, "failed to bind %s", path);
+
+	if (listen(listen_fd, 16) < 0)
+		err(1, "failed to listen on %s", path);
+
+	/* Sessions are never waited for */
+	signal(SIGCHLD, SIG_IGN);
+
+	pfds = calloc(pfds_alloc, sizeof(*pfds));
+	if (!pfds)
+		err(1, "failed to allocate poll array");
+
+	pfds[DAEMON_POLL_LISTEN].fd = listen_fd;
+	pfds[DAEMON_POLL_LISTEN].events = POLLIN;
+	pfds[DAEMON_POLL_HOTPLUG].fd = hotplug_index_open(NULL);
+	pfds[DAEMON_POLL_HOTPLUG].events = POLLIN;
+	pfds[DAEMON_POLL_CONFIG].fd = daemon_config_watch();
+	pfds[DAEMON_POLL_CONFIG].events = POLLIN;
+	pfds[DAEMON_POLL_RELOAD].fd = -1;
+	pfds[DAEMON_POLL_RELOAD].events = POLLIN;
+
+	for (;;) {
+		ret = poll(pfds, nfds, -1);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		else if (ret < 0)
+			err(1, "failed to poll");
+
+		if (pfds[DAEMON_POLL_HOTPLUG].revents)
+			hotplug_index_event();
+
+		if (pfds[DAEMON_POLL_CONFIG].revents &&
+		    daemon_config_event(pfds[DAEMON_POLL_CONFIG].fd))
+			reload_pending = true;
+
+		if (pfds[DAEMON_POLL_RELOAD].revents) {
+			daemon_reload_finish(pfds[DAEMON_POLL_RELOAD].fd);
+			close(pfds[DAEMON_POLL_RELOAD].fd);
+			pfds[DAEMON_POLL_RELOAD].fd = -1;
+		}
+
+		/* Changes made during a reload are picked up by another one */
+		if (reload_pending && pfds[DAEMON_POLL_RELOAD].fd < 0) {
+			pfds[DAEMON_POLL_RELOAD].fd = daemon_reload_start(pfds, nfds);
+			reload_pending = false;
+		}
+
+		/* Drop sessions that have ended, compacting the array */
+		for (i = DAEMON_POLL_SESSIONS; i < nfds; i++) {
+			if (!pfds[i].revents || hotplug_index_serve(pfds[i].fd) == 0)
+				continue;
+
+			hotplug_index_drop(pfds[i].fd);
+			close(pfds[i].fd);
+
+			pfds[i--] = pfds[--nfds];
+		}
+
+		if (!pfds[DAEMON_POLL_LISTEN].revents)
+			continue;
+
+		fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		/* Each session subscribes to hotplug events of its board */
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+			warn("failed to create hotplug socket");
+			close(fd);
+			continue;
+		}
+
+		pid = fork();
+		if (pid < 0) {
+			warn("failed to fork session");
+			close(sv[0]);
+			close(sv[1]);
+			close(fd);
+			continue;
+		} else if (pid > 0) {
+			close(sv[1]);
+			close(fd);
+
+			if (nfds == pfds_alloc) {
+				pfds_alloc *= 2;
+				pfds = realloc(pfds, pfds_alloc * sizeof(*pfds));
+				if (!pfds)
+					err(1, "failed to allocate poll array");
+			}
+
+			pfds[nfds].fd = sv[0];
+			pfds[nfds].events = POLLIN;
+			nfds++;
+			continue;
+		}
+
+		signal(SIGCHLD, SIG_DFL);
+
+		/*
+		 * The session only needs its own ends of the sockets; the
+		 * index, udev monitor included, belongs to the daemon.
+		 */
+		hotplug_index_reset();
+		for (i = 0; i < nfds; i++) {
+			if (i != DAEMON_POLL_HOTPLUG)
+				close(pfds[i].fd);
+		}
+		free(pfds);
+		close(sv[0]);
+
+		if (daemon_session_setup(fd) < 0)
+			exit(1);
+
+		hotplug_use_daemon(sv[1]);
+
+		/* fd stays open for the session, the relay exits as it closes */
+		return;
+	}
+}
@@ -0,0 +1,8 @@
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+const char *daemon_socket_path(void);
+int daemon_relay(const char *path);
+void daemon_run(const char *path);
+
+#endif
@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <err.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "delta.h"
+#include "sha256.h"
+
+/*
+ * rsync style delta encoding. The receiver, holding the previous image,
+ * provides a weak rolling checksum and a truncated SHA-256 digest for each
+ * block of that image. The sender slides a window over the new image and
+ * describes it as a sequence of references to blocks of the previous image
+ * and literal data.
+ */
+
+#define DELTA_HASH_BITS		16
+#define DELTA_HASH_SIZE		(1 << DELTA_HASH_BITS)
+
+size_t delta_block_size(size_t size)
+{
+	size_t block = DELTA_BLOCK_MIN;
+
+	/* Scale block size with the square root of the image size */
+	while (block < DELTA_BLOCK_MAX && block * block < size)
+		block *= 2;
+
+	return block;
+}
+
+uint32_t delta_weak(const uint8_t *buf, size_t len)
+{
+	uint32_t a = 0;
+	uint32_t b = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		a += buf[i];
+		b += (len - i) * buf[i];
+	}
+
+	return (a & 0xffff) | (b << 16);
+}
+
+static uint32_t delta_roll(uint32_t weak, uint8_t out, uint8_t in, size_t len)
+{
+	uint32_t a = weak & 0xffff;
+	uint32_t b = weak >> 16;
+
+	a = (a - out + in) & 0xffff;
+	b = (b - len * out + a) & 0xffff;
+
+	return a | (b << 16);
+}
+
+void delta_strong(const void *buf, size_t len, uint8_t *strong)
+{
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	struct sha256 sha;
+
+	sha256_init(&sha);
+	sha256_update(&sha, buf, len);
+	sha256_final(&sha, digest);
+
+	memcpy(strong, digest, DELTA_STRONG_SIZE);
+}
+
+/**
+ * delta_signature() - calculate block signatures of an image
+ * @buf:	image data
+ * @count:	number of complete blocks in @buf
+ * @block_size:	size of each block
+ * @sigs:	array of @count signatures to fill in
+ */
+void delta_signature(const void *buf, size_t count, size_t block_size,
+		     struct delta_sig *sigs)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		sigs[i].weak = delta_weak(buf + i * block_size, block_size);
+		delta_strong(buf + i * block_size, block_size, sigs[i].strong);
+	}
+}
+
+static unsigned int delta_hash(uint32_t weak)
+{
+	return (weak ^ (weak >> DELTA_HASH_BITS)) & (DELTA_HASH_SIZE - 1);
+}
+
+/**
+ * delta_init() - prepare to describe an image in terms of a previous image
+ * @state:	scan state to initialise
+ * @buf:	new image data
+ * @size:	size of @buf
+ * @sigs:	block signatures of the previous image, kept until the scan ends
+ * @count:	number of entries in @sigs
+ * @block_size:	block size used for @sigs
+ */
+void delta_init(struct delta_state *state, const void *buf, size_t size,
+		const struct delta_sig *sigs, size_t count, size_t block_size)
+{
+	unsigned int idx;
+	size_t i;
+
+	memset(state, 0, sizeof(*state));
+
+	state->buf = buf;
+	state->size = size;
+	state->sigs = sigs;
+	state->count = count;
+	state->block_size = block_size;
+
+	state->head = malloc(DELTA_HASH_SIZE * sizeof(*state->head));
+	state->chain = malloc(count * sizeof(*state->chain));
+	if (!state->head || !state->chain)
+		err(1, "failed to allocate delta hash table");
+
+	/* Chain blocks by weak checksum, SIZE_MAX terminates the chains */
+	memset(state->head, 0xff, DELTA_HASH_SIZE * sizeof(*state->head));
+	for (i = count; i-- > 0;) {
+		idx = delta_hash(sigs[i].weak);
+		state->chain[i] = state->head[idx];
+		state->head[idx] = i;
+	}
+
+	if (size >= block_size)
+		state->weak = delta_weak(buf, block_size);
+}
+
+/**
+ * delta_step() - advance the scan of the new image
+ * @state:	scan state, from delta_init()
+ * @len:	number of bytes of the new image to scan in this step
+ * @ops:	callbacks invoked, in order, for each copy and literal run
+ * @data:	context passed to @ops
+ *
+ * Return: true once the whole image has been described, @state is released
+ */
+bool delta_step(struct delta_state *state, size_t len,
+		const struct delta_ops *ops, void *data)
+{
+	size_t block_size = state->block_size;
+	const struct delta_sig *sigs = state->sigs;
+	uint8_t strong[DELTA_STRONG_SIZE];
+	const uint8_t *p = state->buf;
+	size_t size = state->size;
+	size_t end;
+	bool have_strong;
+	size_t i;
+
+	end = len < size - state->offset ? state->offset + len : size;
+
+	while (state->count && state->offset < end &&
+	       state->offset + block_size <= size) {
+		have_strong = false;
+
+		for (i = state->head[delta_hash(state->weak)]; i != SIZE_MAX;
+		     i = state->chain[i]) {
+			if (sigs[i].weak != state->weak)
+				continue;
+
+			if (!have_strong) {
+				delta_strong(p + state->offset, block_size, strong);
+				have_strong = true;
+			}
+
+			if (!memcmp(sigs[i].strong, strong, DELTA_STRONG_SIZE))
+				break;
+		}
+
+		if (i == SIZE_MAX) {
+			if (state->offset + block_size < size)
+				state->weak = delta_roll(state->weak, p[state->offset],
+							 p[state->offset + block_size],
+							 block_size);
+			state->offset++;
+			continue;
+		}
+
+		if (state->literal < state->offset) {
+			if (state->copy_count) {
+				ops->copy(state->copy_block, state->copy_count, data);
+				state->copy_count = 0;
+			}
+			ops->literal(state->literal, state->offset - state->literal, data);
+		}
+
+		/* Merge consecutive blocks into a single copy operation */
+		if (state->copy_count && state->copy_block + state->copy_count == i) {
+			state->copy_count++;
+		} else {
+			if (state->copy_count)
+				ops->copy(state->copy_block, state->copy_count, data);
+			state->copy_block = i;
+			state->copy_count = 1;
+		}
+
+		state->offset += block_size;
+		state->literal = state->offset;
+
+		if (state->offset + block_size <= size)
+			state->weak = delta_weak(p + state->offset, block_size);
+	}
+
+	/* More of the image remains to be scanned */
+	if (state->count && state->offset + block_size <= size)
+		return false;
+
+	if (state->copy_count)
+		ops->copy(state->copy_block, state->copy_count, data);
+
+	if (state->literal < size)
+		ops->literal(state->literal, size - state->literal, data);
+
+	free(state->chain);
+	free(state->head);
+	state->chain = NULL;
+	state->head = NULL;
+
+	return true;
+}
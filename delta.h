@@ -0,0 +1,70 @@
+#ifndef __DELTA_H__
+#define __DELTA_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cdba.h"
+
+#define DELTA_BLOCK_MIN		4096
+#define DELTA_BLOCK_MAX		65536
+#define DELTA_STRONG_SIZE	8
+
+struct delta_sig {
+	uint32_t weak;
+	uint8_t strong[DELTA_STRONG_SIZE];
+} __packed;
+
+/* Header of the first MSG_FASTBOOT_DELTA_SIGNATURE frame */
+struct delta_sig_hdr {
+	uint32_t block_size;
+	uint32_t count;
+} __packed;
+
+enum {
+	DELTA_OP_COPY = 1,
+	DELTA_OP_LITERAL,
+};
+
+/* Payload of a DELTA_OP_COPY MSG_FASTBOOT_DELTA frame */
+struct delta_copy {
+	uint8_t op;
+	uint32_t block;
+	uint32_t count;
+} __packed;
+
+struct delta_ops {
+	void (*copy)(size_t block, size_t count, void *data);
+	void (*literal)(size_t offset, size_t len, void *data);
+};
+
+/* Progress of describing a new image in terms of the previous image */
+struct delta_state {
+	const uint8_t *buf;
+	size_t size;
+	const struct delta_sig *sigs;
+	size_t count;
+	size_t block_size;
+
+	size_t *head;
+	size_t *chain;
+
+	size_t offset;
+	size_t literal;
+	uint32_t weak;
+	size_t copy_block;
+	size_t copy_count;
+};
+
+size_t delta_block_size(size_t size);
+uint32_t delta_weak(const uint8_t *buf, size_t len);
+void delta_strong(const void *buf, size_t len, uint8_t *strong);
+void delta_signature(const void *buf, size_t count, size_t block_size,
+		     struct delta_sig *sigs);
+void delta_init(struct delta_state *state, const void *buf, size_t size,
+		const struct delta_sig *sigs, size_t count, size_t block_size);
+bool delta_step(struct delta_state *state, size_t len,
+		const struct delta_ops *ops, void *data);
+
+#endif
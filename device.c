@@ -33,28 +33,48 @@
 
 #include <assert.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "cdba-server.h"
+#include "config_cache.h"
 #include "device.h"
+#include "device_parser.h"
 #include "fastboot.h"
 #include "console.h"
-#include "list.h"
+#include "image.h"
 
 #define ARRAY_SIZE(x) ((sizeof(x)/sizeof((x)[0])))
 
-static struct list_head devices = LIST_INIT(devices);
+/* Boards of the configuration cache, instantiated on first use */
+static struct device **devices;
 
-void device_add(struct device *device)
+static struct device *device_get(unsigned int idx)
 {
-	list_add(&devices, &device->node);
+	if (!devices) {
+		devices = calloc(config_cache_boards(), sizeof(*devices));
+		if (!devices)
+			err(1, "failed to allocate devices");
+	}
+
+	if (!devices[idx])
+		devices[idx] = device_parser_board(idx);
+
+	return devices[idx];
 }
 
-static void device_lock(struct device *device)
+/* Interval between attempts to acquire the lock of a busy board */
+#define DEVICE_LOCK_RETRY_MS	1000
+
+static bool device_lock(struct device *device)
 {
 	char lock[PATH_MAX];
 	int fd;
@@ -72,47 +92,112 @@ static void device_lock(struct device *device)
 	if (fd < 0)
 		err(1, "failed to open lockfile %s", lock);
 
+	device->lock_fd = fd;
+
 	n = flock(fd, LOCK_EX | LOCK_NB);
-	if (!n)
+	if (n < 0 && errno != EWOULDBLOCK)
+		err(1, "failed to lock lockfile %s", lock);
+
+	return !n;
+}
+
+static void device_open_locked(struct device *device)
+{
+	device->locked = true;
+
+	if (device->open) {
+		device->cdb = device->open(device);
+		if (!device->cdb)
+			errx(1, "failed to open device controller");
+	}
+
+	if (device->console_dev)
+		console_open(device);
+
+	if (device->usb_always_on)
+		device_usb(device, true);
+
+	device->fastboot = fastboot_open(device->serial, device->fastboot_ops, NULL);
+	fastboot_set_queue_depth(device->fastboot, device->fastboot_queue_depth);
+
+	/* Carry out a power on requested while waiting for the lock */
+	if (device->power_pending) {
+		device->power_pending = false;
+		device_power(device, true);
+	}
+}
+
+/* Let the client know how waiting for a busy board is progressing */
+static void device_lock_status(const char *fmt, ...)
+{
+	va_list ap;
+	char buf[80];
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	cdba_send(MSG_STATUS_UPDATE, buf, MIN(len, sizeof(buf) - 1));
+}
+
+/*
+ * Poll for the lock of a busy board, rather than blocking in flock(), so
+ * that the image upload can be staged while waiting for the board.
+ */
+static void device_lock_retry(void *data)
+{
+	struct device *device = data;
+	time_t waited;
+	int n;
+
+	waited = time(NULL) - device->lock_start;
+
+	n = flock(device->lock_fd, LOCK_EX | LOCK_NB);
+	if (n < 0 && errno != EWOULDBLOCK)
+		err(1, "failed to lock board");
+
+	if (n < 0) {
+		if (waited - device->lock_reported >= 30) {
+			device_lock_status("board is in use, waited %lds...", (long)waited);
+			device->lock_reported = waited;
+		}
+
+		watch_timer_add(DEVICE_LOCK_RETRY_MS, device_lock_retry, device);
 		return;
+	}
 
-	warnx("board is in use, waiting...");
+	device_lock_status("board acquired after %lds", (long)waited);
 
-	n = flock(fd, LOCK_EX);
-	if (n < 0)
-		err(1, "failed to lock lockfile %s", lock);
+	device_open_locked(device);
 }
 
 struct device *device_open(const char *board,
 			   struct fastboot_ops *fastboot_ops)
 {
 	struct device *device;
+	int idx;
 
-	list_for_each_entry(device, &devices, node) {
-		if (!strcmp(device->board, board))
-			goto found;
-	}
+	idx = config_cache_lookup(board, strlen(board));
+	if (idx < 0)
+		return NULL;
 
-	return NULL;
+	device = device_get(idx);
 
-found:
 	assert(device->open || device->console_dev);
 
-	device_lock(device);
+	device->fastboot_ops = fastboot_ops;
 
-	if (device->open) {
-		device->cdb = device->open(device);
-		if (!device->cdb)
-			errx(1, "failed to open device controller");
+	if (device_lock(device)) {
+		device_open_locked(device);
+		return device;
 	}
 
-	if (device->console_dev)
-		console_open(device);
+	device_lock_status("board is in use, waiting...");
 
-	if (device->usb_always_on)
-		device_usb(device, true);
-
-	device->fastboot = fastboot_open(device->serial, fastboot_ops, NULL);
+	device->lock_start = time(NULL);
+	device->lock_reported = 0;
+	watch_timer_add(DEVICE_LOCK_RETRY_MS, device_lock_retry, device);
 
 	return device;
 }
@@ -137,10 +222,19 @@ enum {
 	DEVICE_STATE_RUNNING,
 };
 
+static void device_tick(void *data);
+
+static void device_tick_schedule(struct device *device, int timeout_ms)
+{
+	device->tick_timer = watch_timer_add(timeout_ms, device_tick, device);
+}
+
 static void device_tick(void *data)
 {
 	struct device *device = data;
 
+	device->tick_timer = NULL;
+
 	switch (device->state) {
 	case DEVICE_STATE_START:
 		/* Make sure power key is not engaged */
@@ -150,7 +244,7 @@ static void device_tick(void *data)
 			device_key(device, DEVICE_KEY_POWER, false);
 
 		device->state = DEVICE_STATE_CONNECT;
-		watch_timer_add(10, device_tick, device);
+		device_tick_schedule(device, 10);
 		break;
 	case DEVICE_STATE_CONNECT:
 		/* Connect power and USB */
@@ -159,10 +253,10 @@ static void device_tick(void *data)
 
 		if (device->has_power_key) {
 			device->state = DEVICE_STATE_PRESS;
-			watch_timer_add(250, device_tick, device);
+			device_tick_schedule(device, 250);
 		} else if (device->fastboot_key_timeout) {
 			device->state = DEVICE_STATE_RELEASE_FASTBOOT;
-			watch_timer_add(device->fastboot_key_timeout * 1000, device_tick, device);
+			device_tick_schedule(device, device->fastboot_key_timeout * 1000);
 		} else {
 			device->state = DEVICE_STATE_RUNNING;
 		}
@@ -172,7 +266,7 @@ static void device_tick(void *data)
 		device_key(device, DEVICE_KEY_POWER, true);
 
 		device->state = DEVICE_STATE_RELEASE_PWR;
-		watch_timer_add(100, device_tick, device);
+		device_tick_schedule(device, 100);
 		break;
 	case DEVICE_STATE_RELEASE_PWR:
 		/* Release power key */
@@ -180,7 +274,7 @@ static void device_tick(void *data)
 
 		if (device->fastboot_key_timeout) {
 			device->state = DEVICE_STATE_RELEASE_FASTBOOT;
-			watch_timer_add(device->fastboot_key_timeout * 1000, device_tick, device);
+			device_tick_schedule(device, device->fastboot_key_timeout * 1000);
 		} else {
 			device->state = DEVICE_STATE_RUNNING;
 		}
@@ -197,6 +291,9 @@ static int device_power_on(struct device *device)
 	if (!device || !device->power)
 		return 0;
 
+	/* Restart the sequence if the board is already being powered on */
+	watch_timer_cancel(device->tick_timer);
+
 	device->state = DEVICE_STATE_START;
 	device_tick(device);
 
@@ -208,6 +305,19 @@ static int device_power_off(struct device *device)
 	if (!device || !device->power)
 		return 0;
 
+	/* Abort any power on sequence in progress, releasing its keys */
+	if (device->tick_timer) {
+		watch_timer_cancel(device->tick_timer);
+		device->tick_timer = NULL;
+
+		if (device->fastboot_key_timeout)
+			device_key(device, DEVICE_KEY_FASTBOOT, false);
+		if (device->has_power_key)
+			device_key(device, DEVICE_KEY_POWER, false);
+
+		device->state = DEVICE_STATE_RUNNING;
+	}
+
 	device->power(device, false);
 
 	return 0;
@@ -215,6 +325,12 @@ static int device_power_off(struct device *device)
 
 int device_power(struct device *device, bool on)
 {
+	/* Power is applied once the board has been acquired */
+	if (device && !device->locked) {
+		device->power_pending = on;
+		return 0;
+	}
+
 	if (on)
 		return device_power_on(device);
 	else
@@ -223,23 +339,25 @@ int device_power(struct device *device, bool on)
 
 void device_print_status(struct device *device)
 {
-	if (device->print_status)
+	if (device->locked && device->print_status)
 		device->print_status(device);
 }
 
 void device_usb(struct device *device, bool on)
 {
-	if (device->usb)
+	if (device->locked && device->usb)
 		device->usb(device, on);
 }
 
 int device_write(struct device *device, const void *buf, size_t len)
 {
-	if (!device)
+	if (!device || !device->locked)
 		return 0;
 
 	assert(device->write);
 
+	clock_gettime(CLOCK_MONOTONIC, &device->console_input);
+
 	return device->write(device, buf, len);
 }
 
@@ -254,69 +372,240 @@ void device_fastboot_flash_reboot(struct device *device)
 	fastboot_reboot(device->fastboot);
 }
 
-void device_boot(struct device *device, const void *data, size_t len)
+static int device_boot_start(struct device *device, size_t len)
 {
 	warnx("booting the board...");
 	if (device->set_active)
 		fastboot_set_active(device->fastboot, "a");
-	fastboot_download(device->fastboot, data, len);
-	device->boot(device);
+	return fastboot_download_start(device->fastboot, len);
+}
+
+/* Granularity of the progress reported to the boot_progress callback */
+#define DEVICE_BOOT_PROGRESS_STEP	(256 * 1024)
+
+enum {
+	BOOT_EVENT_PROGRESS,
+	BOOT_EVENT_DONE,
+};
+
+struct boot_event {
+	struct device *device;
+	int type;
+	int ret;
+	size_t offset;
+	size_t size;
+};
+
+static int boot_event_fds[2] = { -1, -1 };
+
+static void device_boot_post(struct device *device, int type, int ret,
+			     size_t offset, size_t size)
+{
+	struct boot_event event = { device, type, ret, offset, size };
+	ssize_t n;
+
+	n = write(boot_event_fds[1], &event, sizeof(event));
+	if (n != sizeof(event))
+		warn("failed to post boot event");
+}
+
+/*
+ * Boot worker, performs the fastboot download of the image as it is being
+ * staged and then boots the board. This runs in its own thread, so that the
+ * main loop continues to serve the console while the download is in progress.
+ */
+static void *device_boot_worker(void *data)
+{
+	struct device *device = data;
+	struct image *image = device->boot_image;
+	size_t reported = 0;
+	size_t offset = 0;
+	size_t avail;
+	size_t size;
+	int ret;
+
+	size = image->size ? image->size : image->len;
+
+	ret = device_boot_start(device, size);
+	while (!ret && offset < size) {
+		avail = image_wait(image, offset);
+		if (avail <= offset || image_failed(image))
+			break;
+
+		ret = fastboot_download_write(device->fastboot,
+					      image->ptr + offset,
+					      avail - offset);
+		offset = avail;
+
+		/* Report progress for every step, or 10%, transferred */
+		if (offset - reported >= MIN(size / 10, DEVICE_BOOT_PROGRESS_STEP) ||
+		    offset == size) {
+			device_boot_post(device, BOOT_EVENT_PROGRESS, 0, offset, size);
+			reported = offset;
+		}
+	}
+
+	ret = fastboot_download_finish(device->fastboot);
+	if (image_failed(image)) {
+		warnx("image upload failed, not booting the board");
+		ret = -EIO;
+	} else if (ret < 0) {
+		warnx("failed to download image to the board");
+	} else {
+		device->boot(device);
+	}
+
+	device_boot_post(device, BOOT_EVENT_DONE, ret, offset, size);
+
+	return NULL;
+}
+
+static int device_boot_event(int fd, void *data)
+{
+	struct boot_event event;
+	struct device *device;
+	ssize_t n;
+
+	n = read(fd, &event, sizeof(event));
+	if (n < 0)
+		return errno == EAGAIN ? 0 : n;
+	if (n != sizeof(event))
+		return -1;
+
+	device = event.device;
+
+	switch (event.type) {
+	case BOOT_EVENT_PROGRESS:
+		/* Print progress for every 10% transferred */
+		if (event.offset - device->boot_reported >= event.size / 10) {
+			fprintf(stderr, "fastboot: %zu/%zu bytes\n", event.offset, event.size);
+			device->boot_reported = event.offset;
+		}
+
+		if (device->boot_progress)
+			device->boot_progress(device, event.offset);
+		break;
+	case BOOT_EVENT_DONE:
+		pthread_join(device->boot_thread, NULL);
+		fastboot_release(device->fastboot);
+
+		device->boot_image = NULL;
+		device->boot_done(device, event.ret);
+		break;
+	}
+
+	return 0;
+}
+
+/**
+ * device_boot() - download and boot an image on the device
+ * @device:	device to boot
+ * @image:	staged image, which may still be in the process of being received
+ * @progress:	callback invoked from the main loop as the download progresses,
+ *		with the number of bytes handed to the device, may be NULL
+ * @done:	callback invoked from the main loop once the boot has completed
+ *
+ * The fastboot operations are performed by a worker thread, the download
+ * starts immediately and progresses as data is staged in @image. @image must
+ * remain valid until @done has been invoked.
+ *
+ * Return: 0 on success, negative errno if a boot is already in progress
+ */
+int device_boot(struct device *device, struct image *image,
+		void (*progress)(struct device *, size_t),
+		void (*done)(struct device *, int))
+{
+	int flags;
+	int ret;
+
+	if (device->boot_image)
+		return -EBUSY;
+
+	if (boot_event_fds[0] < 0) {
+		ret = pipe(boot_event_fds);
+		if (ret < 0)
+			err(1, "failed to create boot event pipe");
+
+		flags = fcntl(boot_event_fds[0], F_GETFL, 0);
+		fcntl(boot_event_fds[0], F_SETFL, flags | O_NONBLOCK);
+
+		watch_add_readfd(boot_event_fds[0], device_boot_event, NULL);
+	}
+
+	/* Legacy uploads of unknown size are booted once complete */
+	if (!image->size && !image_data(image))
+		return -EINVAL;
+
+	device->boot_image = image;
+	device->boot_progress = progress;
+	device->boot_done = done;
+	device->boot_reported = 0;
+
+	fastboot_hold(device->fastboot);
+
+	ret = pthread_create(&device->boot_thread, NULL, device_boot_worker, device);
+	if (ret) {
+		errno = ret;
+		err(1, "failed to create boot worker");
+	}
+
+	return 0;
 }
 
 void device_send_break(struct device *device)
 {
-	if (device->send_break)
+	if (device->locked && device->send_break)
 		device->send_break(device);
 }
 
 void device_list_devices(void)
 {
 	struct device *device;
-	struct msg hdr;
+	unsigned int i;
 	size_t len;
 	char buf[80];
 
-	list_for_each_entry(device, &devices, node) {
+	for (i = 0; i < config_cache_boards(); i++) {
+		device = device_get(i);
+
 		if (device->name)
 			len = snprintf(buf, sizeof(buf), "%-20s %s", device->board, device->name);
 		else
 			len = snprintf(buf, sizeof(buf), "%s", device->board);
 
-		hdr.type = MSG_LIST_DEVICES;
-		hdr.len = len;
-		write(STDOUT_FILENO, &hdr, sizeof(hdr));
-		write(STDOUT_FILENO, buf, len);
+		cdba_send(MSG_LIST_DEVICES, buf, len);
 	}
 
-	hdr.type = MSG_LIST_DEVICES;
-	hdr.len = 0;
-	write(STDOUT_FILENO, &hdr, sizeof(hdr));
+	cdba_send(MSG_LIST_DEVICES, NULL, 0);
 }
 
 void device_info(const void *data, size_t dlen)
 {
 	struct device *device;
-	struct msg hdr;
-	char *description;
+	char *description = NULL;
 	size_t len = 0;
+	int idx;
 
-	list_for_each_entry(device, &devices, node) {
-		if (!strncmp(device->board, data, dlen) && device->description) {
+	idx = config_cache_lookup(data, strnlen(data, dlen));
+	if (idx >= 0) {
+		device = device_get(idx);
+		if (device->description) {
 			description = device->description;
 			len = strlen(device->description);
-			break;
 		}
 	}
 
-	hdr.type = MSG_BOARD_INFO;
-	hdr.len = len;
-	write(STDOUT_FILENO, &hdr, sizeof(hdr));
-	if (len)
-		write(STDOUT_FILENO, description, len);
+	cdba_send(MSG_BOARD_INFO, description, len);
 }
 
 void device_close(struct device *dev)
 {
+	if (!dev->locked)
+		return;
+
+	if (dev->console_dev)
+		console_close(dev);
+
 	if (!dev->usb_always_on)
 		device_usb(dev, false);
 	device_power(dev, false);
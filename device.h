@@ -1,10 +1,14 @@
 #ifndef __DEVICE_H__
 #define __DEVICE_H__
 
+#include <pthread.h>
 #include <termios.h>
+#include <time.h>
 #include "list.h"
 
 struct cdb_assist;
+struct console_capture;
+struct image;
 struct fastboot;
 struct fastboot_ops;
 
@@ -19,10 +23,19 @@ struct device {
 	bool tickle_mmc;
 	bool usb_always_on;
 	struct fastboot *fastboot;
+	struct fastboot_ops *fastboot_ops;
 	unsigned int fastboot_key_timeout;
+	unsigned int fastboot_queue_depth;
 	int state;
+	struct timer *tick_timer;
 	bool has_power_key;
 
+	int lock_fd;
+	bool locked;
+	time_t lock_start;
+	time_t lock_reported;
+	bool power_pending;
+
 	void (*boot)(struct device *);
 
 	void *(*open)(struct device *dev);
@@ -41,12 +54,24 @@ struct device {
 
 	int console_fd;
 	struct termios console_tios;
-
-	struct list_head node;
+	struct timespec console_input;
+	bool console_capture_thread;
+	int console_capture_priority;
+	struct console_capture *console_capture;
+
+	unsigned int console_batch_size;
+	unsigned int console_batch_ms;
+	char *console_batch;
+	size_t console_batch_len;
+	struct timer *console_batch_timer;
+
+	struct image *boot_image;
+	pthread_t boot_thread;
+	void (*boot_progress)(struct device *dev, size_t offset);
+	void (*boot_done)(struct device *dev, int ret);
+	size_t boot_reported;
 };
 
-void device_add(struct device *device);
-
 struct device *device_open(const char *board, struct fastboot_ops *fastboot_ops);
 void device_close(struct device *dev);
 int device_power(struct device *device, bool on);
@@ -55,7 +80,9 @@ void device_print_status(struct device *device);
 void device_usb(struct device *device, bool on);
 int device_write(struct device *device, const void *buf, size_t len);
 
-void device_boot(struct device *device, const void *data, size_t len);
+int device_boot(struct device *device, struct image *image,
+		void (*progress)(struct device *, size_t),
+		void (*done)(struct device *, int));
 
 void device_fastboot_boot(struct device *device);
 void device_fastboot_flash_reboot(struct device *device);
@@ -28,15 +28,18 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#include <sched.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <yaml.h>
 
+#include "config_cache.h"
 #include "device.h"
 #include "alpaca.h"
 #include "cdb_assist.h"
 #include "conmux.h"
 #include "console.h"
+#include "device_parser.h"
 #include "qcomlt_dbg.h"
 
 #define TOKEN_LENGTH	16384
@@ -80,76 +83,138 @@ static bool expect(struct device_parser *dp, int type, char *scalar)
 	exit(1);
 }
 
+static void device_parser_apply(struct device *dev, const char *key, const char *value)
+{
+	if (!strcmp(key, "board")) {
+		dev->board = strdup(value);
+	} else if (!strcmp(key, "name")) {
+		dev->name = strdup(value);
+	} else if (!strcmp(key, "cdba")) {
+		dev->control_dev = strdup(value);
+
+		dev->open = cdb_assist_open;
+		dev->close = cdb_assist_close;
+		dev->power = cdb_assist_power;
+		dev->print_status = cdb_assist_print_status;
+		dev->usb = cdb_assist_usb;
+		dev->key = cdb_assist_key;
+	} else if (!strcmp(key, "conmux")) {
+		dev->control_dev = strdup(value);
+
+		dev->open = conmux_open;
+		dev->power = conmux_power;
+		dev->write = conmux_write;
+	} else if (!strcmp(key, "alpaca")) {
+		dev->control_dev = strdup(value);
+
+		dev->open = alpaca_open;
+		dev->power = alpaca_power;
+		dev->usb = alpaca_usb;
+		dev->key = alpaca_key;
+	} else if (!strcmp(key, "qcomlt_debug_board")) {
+		dev->control_dev = strdup(value);
+
+		dev->open = qcomlt_dbg_open;
+		dev->power = qcomlt_dbg_power;
+		dev->usb = qcomlt_dbg_usb;
+		dev->key = qcomlt_dbg_key;
+	} else if (!strcmp(key, "console")) {
+		dev->console_dev = strdup(value);
+		dev->write = console_write;
+		dev->send_break = console_send_break;
+	} else if (!strcmp(key, "voltage")) {
+		dev->voltage = strtoul(value, NULL, 10);
+	} else if (!strcmp(key, "fastboot")) {
+		dev->serial = strdup(value);
+
+		if (!dev->boot)
+			dev->boot = device_fastboot_boot;
+	} else if (!strcmp(key, "fastboot_set_active")) {
+		dev->set_active = !strcmp(value, "true");
+	} else if (!strcmp(key, "broken_fastboot_boot")) {
+		if (!strcmp(value, "true"))
+			dev->boot = device_fastboot_flash_reboot;
+	} else if (!strcmp(key, "description")) {
+		dev->description = strdup(value);
+	} else if (!strcmp(key, "fastboot_key_timeout")) {
+		dev->fastboot_key_timeout = strtoul(value, NULL, 10);
+	} else if (!strcmp(key, "fastboot_queue_depth")) {
+		dev->fastboot_queue_depth = strtoul(value, NULL, 10);
+	} else if (!strcmp(key, "usb_always_on")) {
+		dev->usb_always_on = !strcmp(value, "true");
+	} else if (!strcmp(key, "console_batch_size")) {
+		dev->console_batch_size = strtoul(value, NULL, 10);
+		if (!dev->console_batch_size || dev->console_batch_size > CONSOLE_BATCH_SIZE_MAX) {
+			fprintf(stderr, "device parser: console_batch_size out of range\n");
+			exit(1);
+		}
+	} else if (!strcmp(key, "console_batch_ms")) {
+		dev->console_batch_ms = strtoul(value, NULL, 10);
+	} else if (!strcmp(key, "console_capture_thread")) {
+		dev->console_capture_thread = !strcmp(value, "true");
+	} else if (!strcmp(key, "console_capture_priority")) {
+		dev->console_capture_priority = strtoul(value, NULL, 10);
+		if (dev->console_capture_priority < sched_get_priority_min(SCHED_FIFO) ||
+		    dev->console_capture_priority > sched_get_priority_max(SCHED_FIFO)) {
+			fprintf(stderr, "device parser: console_capture_priority out of range\n");
+			exit(1);
+		}
+		dev->console_capture_thread = true;
+	} else {
+		fprintf(stderr, "device parser: unknown key \"%s\"\n", key);
+		exit(1);
+	}
+}
+
 static void parse_board(struct device_parser *dp)
 {
-	struct device *dev;
 	char value[TOKEN_LENGTH];
 	char key[TOKEN_LENGTH];
 
-	dev = calloc(1, sizeof(*dev));
+	config_cache_build_board();
 
 	while (accept(dp, YAML_SCALAR_EVENT, key)) {
 		expect(dp, YAML_SCALAR_EVENT, value);
 
-		if (!strcmp(key, "board")) {
-			dev->board = strdup(value);
-		} else if (!strcmp(key, "name")) {
-			dev->name = strdup(value);
-		} else if (!strcmp(key, "cdba")) {
-			dev->control_dev = strdup(value);
-
-			dev->open = cdb_assist_open;
-			dev->close = cdb_assist_close;
-			dev->power = cdb_assist_power;
-			dev->print_status = cdb_assist_print_status;
-			dev->usb = cdb_assist_usb;
-			dev->key = cdb_assist_key;
-		} else if (!strcmp(key, "conmux")) {
-			dev->control_dev = strdup(value);
-
-			dev->open = conmux_open;
-			dev->power = conmux_power;
-			dev->write = conmux_write;
-		} else if (!strcmp(key, "alpaca")) {
-			dev->control_dev = strdup(value);
-
-			dev->open = alpaca_open;
-			dev->power = alpaca_power;
-			dev->usb = alpaca_usb;
-			dev->key = alpaca_key;
-		} else if (!strcmp(key, "qcomlt_debug_board")) {
-			dev->control_dev = strdup(value);
-
-			dev->open = qcomlt_dbg_open;
-			dev->power = qcomlt_dbg_power;
-			dev->usb = qcomlt_dbg_usb;
-			dev->key = qcomlt_dbg_key;
-		} else if (!strcmp(key, "console")) {
-			dev->console_dev = strdup(value);
-			dev->write = console_write;
-			dev->send_break = console_send_break;
-		} else if (!strcmp(key, "voltage")) {
-			dev->voltage = strtoul(value, NULL, 10);
-		} else if (!strcmp(key, "fastboot")) {
-			dev->serial = strdup(value);
-
-			if (!dev->boot)
-				dev->boot = device_fastboot_boot;
-		} else if (!strcmp(key, "fastboot_set_active")) {
-			dev->set_active = !strcmp(value, "true");
-		} else if (!strcmp(key, "broken_fastboot_boot")) {
-			if (!strcmp(value, "true"))
-				dev->boot = device_fastboot_flash_reboot;
-		} else if (!strcmp(key, "description")) {
-			dev->description = strdup(value);
-		} else if (!strcmp(key, "fastboot_key_timeout")) {
-			dev->fastboot_key_timeout = strtoul(value, NULL, 10);
-		} else if (!strcmp(key, "usb_always_on")) {
-			dev->usb_always_on = !strcmp(value, "true");
-		} else {
-			fprintf(stderr, "device parser: unknown key \"%s\"\n", key);
-			exit(1);
-		}
+		config_cache_build_pair(key, value);
+	}
+}
+
+/**
+ * device_parser_free() - release a board instantiated by device_parser_board()
+ * @dev:	device to release, must not be open
+ */
+void device_parser_free(struct device *dev)
+{
+	free(dev->board);
+	free(dev->name);
+	free(dev->control_dev);
+	free(dev->console_dev);
+	free(dev->serial);
+	free(dev->description);
+	free(dev);
+}
+
+/**
+ * device_parser_board() - instantiate a board from the configuration cache
+ * @idx:	index of the board in the configuration cache
+ *
+ * Return: newly allocated device; exits on invalid configuration
+ */
+struct device *device_parser_board(unsigned int idx)
+{
+	const char *value;
+	const char *key;
+	struct device *dev;
+	unsigned int i;
+
+	dev = calloc(1, sizeof(*dev));
+	dev->console_batch_size = CONSOLE_BATCH_SIZE;
+	dev->console_batch_ms = CONSOLE_BATCH_MS;
+
+	for (i = 0; i < config_cache_pairs(idx); i++) {
+		config_cache_pair(idx, i, &key, &value);
+		device_parser_apply(dev, key, value);
 	}
 
 	if (!dev->board || !dev->serial || !(dev->open || dev->console_dev)) {
@@ -157,19 +222,30 @@ static void parse_board(struct device_parser *dp)
 		exit(1);
 	}
 
-	device_add(dev);
+	return dev;
 }
 
+const char * const device_parser_configs[DEVICE_PARSER_CONFIGS] = {
+	".cdba",
+	"/etc/cdba",
+};
+
 int device_parser(const char *path)
 {
 	struct device_parser dp;
 	char key[TOKEN_LENGTH];
+	unsigned int i;
 	FILE *fh;
 
 	fh = fopen(path, "r");
 	if (!fh)
 		return -1;
 
+	if (!config_cache_load(path)) {
+		fclose(fh);
+		return 0;
+	}
+
 	if(!yaml_parser_initialize(&dp.parser)) {
 		fprintf(stderr, "device parser: failed to initialize parser\n");
 		return -1;
@@ -177,6 +253,8 @@ int device_parser(const char *path)
 
 	yaml_parser_set_input_file(&dp.parser, fh);
 
+	config_cache_build_begin();
+
 	nextsym(&dp);
 
 	expect(&dp, YAML_STREAM_START_EVENT, NULL);
@@ -204,5 +282,30 @@ int device_parser(const char *path)
 
 	fclose(fh);
 
+	config_cache_build_end(path);
+
+	/* Validate all boards, so that a broken cache is never written */
+	for (i = 0; i < config_cache_boards(); i++)
+		device_parser_free(device_parser_board(i));
+
+	config_cache_save();
+
 	return 0;
 }
+
+/**
+ * device_parser_default() - parse the first configuration file that exists
+ *
+ * Return: index in device_parser_configs of the parsed file, -1 if none exists
+ */
+int device_parser_default(void)
+{
+	int i;
+
+	for (i = 0; i < DEVICE_PARSER_CONFIGS; i++) {
+		if (!device_parser(device_parser_configs[i]))
+			return i;
+	}
+
+	return -1;
+}
@@ -1,6 +1,15 @@
 #ifndef __DEVICE_PARSER_H__
 #define __DEVICE_PARSER_H__
 
+struct device;
+
+/* Configuration files, in order of precedence */
+#define DEVICE_PARSER_CONFIGS	2
+extern const char * const device_parser_configs[DEVICE_PARSER_CONFIGS];
+
 int device_parser(const char *path);
+int device_parser_default(void);
+struct device *device_parser_board(unsigned int idx);
+void device_parser_free(struct device *dev);
 
 #endif
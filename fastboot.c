@@ -32,12 +32,13 @@
 #include <linux/usb/ch9.h>
 
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 
 #include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <libudev.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -46,9 +47,29 @@
 
 #include "cdba-server.h"
 #include "fastboot.h"
+#include "hotplug.h"
+#include "list.h"
 
 #define MAX_USBFS_BULK_SIZE (16*1024)
 
+#define FASTBOOT_URB_SIZE	(64*1024)
+#define FASTBOOT_URB_TIMEOUT	1000
+#define FASTBOOT_QUEUE_DEPTH	8
+
+struct fastboot_urb {
+	struct usbdevfs_urb urb;
+	void *buf;
+	bool busy;
+};
+
+/* Hotplug event received while a worker is using the fastboot device */
+struct fastboot_hotplug {
+	char *dev_path;
+	char *dev_node;
+
+	struct list_head node;
+};
+
 struct fastboot {
 	const char *serial;
 
@@ -56,7 +77,7 @@ struct fastboot {
 	unsigned ep_in;
 	unsigned ep_out;
 
-	const char *dev_path;
+	char *dev_path;
 
 	void *data;
 
@@ -64,7 +85,19 @@ struct fastboot {
 
 	int state;
 
-	struct udev_monitor *mon;
+	bool busy;
+	struct list_head pending;
+
+	/* streaming download state */
+	struct fastboot_urb *urbs;
+	unsigned int queue_depth;
+	unsigned int urb_next;
+	unsigned int urb_busy;
+	bool urb_mmap;
+
+	size_t xfer_fill;
+	size_t xfer_left;
+	bool xfer_failed;
 };
 
 enum {
@@ -248,18 +281,14 @@ static int parse_usb_desc(int usbfd, unsigned *ep_in, unsigned *ep_out)
 	return -ENOENT;
 }
 
-static int handle_fastboot_add(struct fastboot *fastboot, struct udev_device *dev)
+static int handle_fastboot_add(struct fastboot *fastboot, const char *dev_path,
+			       const char *dev_node)
 {
-	const char *dev_path;
-	const char *dev_node;
 	unsigned ep_out;
 	unsigned ep_in;
 	int usbfd;
 	int ret;
 
-	dev_path = udev_device_get_devpath(dev);
-	dev_node = udev_device_get_devnode(dev);
-
 	usbfd = open(dev_node, O_RDWR);
 	if (usbfd < 0)
 		return usbfd;
@@ -283,59 +312,48 @@ static int handle_fastboot_add(struct fastboot *fastboot, struct udev_device *de
 	return 0;
 }
 
-static int handle_udev_event(int fd, void *data)
+static void handle_fastboot_remove(struct fastboot *fastboot, const char *dev_path)
 {
-	struct fastboot *fastboot = data;
-	struct udev_device* dev;
-	const char *dev_path;
-	const char *action;
-	const char *serial;
-
-	dev = udev_monitor_receive_device(fastboot->mon);
-
-	action = udev_device_get_action(dev);
-	dev_path = udev_device_get_devpath(dev);
-
-	if (!action || !dev_path)
-		goto unref_dev;
+	if (!fastboot->dev_path || strcmp(dev_path, fastboot->dev_path))
+		return;
 
-	if (!strcmp(action, "add")) {
-		serial = udev_device_get_sysattr_value(dev, "serial");
-		if (!serial || strcmp(serial, fastboot->serial))
-			goto unref_dev;
+	close(fastboot->fd);
+	fastboot->fd = -1;
+	free(fastboot->dev_path);
+	fastboot->dev_path = NULL;
 
-		handle_fastboot_add(fastboot, dev);
-	} else if (!strcmp(action, "remove")) {
-		if (!fastboot->dev_path || strcmp(dev_path, fastboot->dev_path))
-			goto unref_dev;
+	if (fastboot->ops && fastboot->ops->disconnect)
+		fastboot->ops->disconnect(fastboot->data);
 
-		close(fastboot->fd);
-		fastboot->fd = -1;
-		fastboot->dev_path = NULL;
-
-		if (fastboot->ops && fastboot->ops->disconnect)
-			fastboot->ops->disconnect(fastboot->data);
+	fastboot->state = FASTBOOT_STATE_CLOSED;
+}
 
-		fastboot->state = FASTBOOT_STATE_CLOSED;
+static void handle_hotplug(const char *dev_path, const char *dev_node, void *data)
+{
+	struct fastboot *fastboot = data;
+	struct fastboot_hotplug *event;
+
+	/* The worker owns the device, replay the event once it's released */
+	if (fastboot->busy) {
+		event = calloc(1, sizeof(*event));
+		if (!event)
+			err(1, "failed to allocate hotplug event");
+
+		event->dev_path = strdup(dev_path);
+		event->dev_node = dev_node ? strdup(dev_node) : NULL;
+		list_add(&fastboot->pending, &event->node);
+		return;
 	}
 
-unref_dev:
-	udev_device_unref(dev);
-
-	return 0;
+	if (dev_node)
+		handle_fastboot_add(fastboot, dev_path, dev_node);
+	else
+		handle_fastboot_remove(fastboot, dev_path);
 }
-	
+
 struct fastboot *fastboot_open(const char *serial, struct fastboot_ops *ops, void *data)
 {
 	struct fastboot *fb;
-	struct udev* udev;
-	int fd;
-	struct udev_enumerate* udev_enum;
-	struct udev_list_entry* first, *item;
-
-	udev = udev_new();
-	if (!udev)
-		err(1, "udev_new() failed");
 
 	fb = calloc(1, sizeof(struct fastboot));
 	if (!fb)
@@ -344,33 +362,12 @@ struct fastboot *fastboot_open(const char *serial, struct fastboot_ops *ops, voi
 	fb->serial = serial;
 	fb->ops = ops;
 	fb->data = data;
-	
-	fb->state = FASTBOOT_STATE_START;
-	
-	fb->mon = udev_monitor_new_from_netlink(udev, "udev");
-	udev_monitor_filter_add_match_subsystem_devtype(fb->mon, "usb", NULL);
-	udev_monitor_enable_receiving(fb->mon);
+	fb->queue_depth = FASTBOOT_QUEUE_DEPTH;
+	list_init(&fb->pending);
 
-	fd = udev_monitor_get_fd(fb->mon);
-
-	watch_add_readfd(fd, handle_udev_event, fb);
-
-	udev_enum = udev_enumerate_new(udev);
-	udev_enumerate_add_match_subsystem(udev_enum, "usb");
-	udev_enumerate_add_match_sysattr(udev_enum, "serial", serial);
-	udev_enumerate_scan_devices(udev_enum);
-
-	first = udev_enumerate_get_list_entry(udev_enum);
-	udev_list_entry_foreach(item, first) {
-		const char *path;
-		struct udev_device *dev;
-
-		path = udev_list_entry_get_name(item);
-		dev = udev_device_new_from_syspath(udev, path);
-		handle_fastboot_add(fb, dev);
-	}
+	fb->state = FASTBOOT_STATE_START;
 
-	udev_enumerate_unref(udev_enum);
+	hotplug_subscribe(serial, handle_hotplug, fb);
 
 	return fb;
 }
@@ -386,46 +383,318 @@ int fastboot_getvar(struct fastboot *fb, const char *var, char *buf, size_t len)
 	return fastboot_read(fb, buf, len);
 }
 
-int fastboot_download(struct fastboot *fb, const void *data, size_t len)
+/*
+ * Allocate the URB buffers for a download. usbfs can provide DMA capable
+ * memory by mmap() of the device node, which avoids a copy through a bounce
+ * buffer in the kernel; fall back to regular memory if this isn't supported.
+ */
+static void fastboot_urbs_alloc(struct fastboot *fb)
 {
-	size_t xfer;
-	ssize_t n;
-	size_t offset = 0;
+	struct fastboot_urb *urb;
+	unsigned int i;
 	void *buf;
+
+	fb->urbs = calloc(fb->queue_depth, sizeof(*fb->urbs));
+	if (!fb->urbs)
+		err(1, "failed to allocate usb request blocks");
+
+	buf = mmap(NULL, fb->queue_depth * FASTBOOT_URB_SIZE,
+		   PROT_READ | PROT_WRITE, MAP_SHARED, fb->fd, 0);
+	fb->urb_mmap = buf != MAP_FAILED;
+	if (!fb->urb_mmap) {
+		buf = malloc(fb->queue_depth * FASTBOOT_URB_SIZE);
+		if (!buf)
+			err(1, "failed to allocate usb transfer buffers");
+	}
+
+	for (i = 0; i < fb->queue_depth; i++) {
+		urb = &fb->urbs[i];
+		urb->buf = buf + i * FASTBOOT_URB_SIZE;
+		urb->urb.usercontext = urb;
+	}
+
+	fb->urb_next = 0;
+	fb->urb_busy = 0;
+}
+
+static void fastboot_urbs_free(struct fastboot *fb)
+{
+	if (!fb->urbs)
+		return;
+
+	if (fb->urb_mmap)
+		munmap(fb->urbs[0].buf, fb->queue_depth * FASTBOOT_URB_SIZE);
+	else
+		free(fb->urbs[0].buf);
+
+	free(fb->urbs);
+	fb->urbs = NULL;
+}
+
+static void fastboot_urbs_discard(struct fastboot *fb)
+{
+	struct usbdevfs_urb *urbp;
+	unsigned int i;
+
+	for (i = 0; i < fb->queue_depth; i++) {
+		if (fb->urbs[i].busy)
+			ioctl(fb->fd, USBDEVFS_DISCARDURB, &fb->urbs[i].urb);
+	}
+
+	while (fb->urb_busy) {
+		if (ioctl(fb->fd, USBDEVFS_REAPURB, &urbp) < 0)
+			break;
+
+		((struct fastboot_urb *)urbp->usercontext)->busy = false;
+		fb->urb_busy--;
+	}
+}
+
+/* Wait for the oldest outstanding URB to complete */
+static int fastboot_urb_reap(struct fastboot *fb)
+{
+	struct pollfd pfd = { .fd = fb->fd, .events = POLLOUT };
+	struct usbdevfs_urb *urbp;
+	struct fastboot_urb *urb;
+	int ret;
+
+	for (;;) {
+		ret = ioctl(fb->fd, USBDEVFS_REAPURBNDELAY, &urbp);
+		if (!ret)
+			break;
+
+		if (errno != EAGAIN) {
+			warn("failed to reap usb bulk transfer");
+			return -1;
+		}
+
+		ret = poll(&pfd, 1, FASTBOOT_URB_TIMEOUT);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		} else if (ret <= 0) {
+			warnx("timeout waiting for usb bulk transfer");
+			return -1;
+		}
+	}
+
+	urb = urbp->usercontext;
+	urb->busy = false;
+	fb->urb_busy--;
+
+	if (urbp->status || urbp->actual_length != urbp->buffer_length) {
+		warnx("usb bulk transfer failed: %d", urbp->status);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int fastboot_urb_submit(struct fastboot *fb, struct fastboot_urb *urb, size_t len)
+{
+	int ret;
+
+	urb->urb.type = USBDEVFS_URB_TYPE_BULK;
+	urb->urb.endpoint = fb->ep_out;
+	urb->urb.buffer = urb->buf;
+	urb->urb.buffer_length = len;
+
+	ret = ioctl(fb->fd, USBDEVFS_SUBMITURB, &urb->urb);
+	if (ret < 0) {
+		warn("failed to submit usb bulk transfer");
+		return -1;
+	}
+
+	urb->busy = true;
+	fb->urb_busy++;
+	fb->urb_next = (fb->urb_next + 1) % fb->queue_depth;
+
+	return 0;
+}
+
+/**
+ * fastboot_hold() - mark the fastboot device as in use by a worker
+ * @fb:		fastboot handle
+ *
+ * Operations may be performed on the fastboot device from another thread
+ * between fastboot_hold() and fastboot_release(). Hotplug events received in
+ * the meantime are queued and handled as the device is released, so the fd,
+ * endpoints and state seen by the worker don't change underneath it; if the
+ * device goes away the worker's transfers fail on the stale fd instead.
+ */
+void fastboot_hold(struct fastboot *fb)
+{
+	fb->busy = true;
+}
+
+void fastboot_release(struct fastboot *fb)
+{
+	struct fastboot_hotplug *event;
+	struct fastboot_hotplug *next;
+
+	fb->busy = false;
+
+	list_for_each_entry_safe(event, next, &fb->pending, node) {
+		list_del(&event->node);
+
+		handle_hotplug(event->dev_path, event->dev_node, fb);
+
+		free(event->dev_path);
+		free(event->dev_node);
+		free(event);
+	}
+}
+
+/**
+ * fastboot_set_queue_depth() - set number of concurrent download transfers
+ * @fb:		fastboot handle
+ * @depth:	number of URBs to keep in flight during downloads
+ */
+void fastboot_set_queue_depth(struct fastboot *fb, unsigned int depth)
+{
+	fb->queue_depth = depth ? depth : FASTBOOT_QUEUE_DEPTH;
+}
+
+/**
+ * fastboot_download_start() - initiate a streaming download
+ * @fb:		fastboot handle
+ * @len:	total number of bytes that will follow
+ *
+ * Issues the "download" command for @len bytes, the payload is then provided
+ * in arbitrarily sized pieces using fastboot_download_write() and the transfer
+ * is concluded by fastboot_download_finish().
+ *
+ * Return: 0 on success, negative on failure
+ */
+int fastboot_download_start(struct fastboot *fb, size_t len)
+{
+	char buf[65];
 	char cmd[32];
-	int ret = 0;
+	ssize_t n;
 
-	buf = malloc(MAX_USBFS_BULK_SIZE);
-	if (!buf)
-		err(1, "failed to allocate usb scratch buffer");
+	fb->xfer_fill = 0;
+	fb->xfer_left = len;
+	fb->xfer_failed = false;
 
 	n = sprintf(cmd, "download:%08x", (unsigned int)len);
 	fastboot_write(fb, cmd, n);
 
-	n = fastboot_read(fb, buf, MAX_USBFS_BULK_SIZE);
+	n = fastboot_read(fb, buf, sizeof(buf));
 	if (n < 0) {
 		fprintf(stderr, "remote rejected download request\n");
+		fb->xfer_failed = true;
+		return -1;
+	}
+
+	fastboot_urbs_alloc(fb);
+
+	return 0;
+}
+
+/**
+ * fastboot_download_write() - provide payload for an active download
+ * @fb:		fastboot handle
+ * @data:	payload chunk
+ * @len:	size of @data
+ *
+ * Payload is gathered into URB sized transfers, which are submitted
+ * asynchronously; up to queue_depth transfers are kept in flight so that the
+ * host controller is kept busy while more data is being provided.
+ *
+ * Return: 0 on success, negative on failure
+ */
+int fastboot_download_write(struct fastboot *fb, const void *data, size_t len)
+{
+	struct fastboot_urb *urb;
+	size_t xfer;
+	int ret;
+
+	if (fb->xfer_failed)
 		return -1;
+
+	if (len > fb->xfer_left) {
+		warnx("download payload exceeds announced size");
+		len = fb->xfer_left;
 	}
 
 	while (len > 0) {
-		xfer = MIN(len, MAX_USBFS_BULK_SIZE);
+		urb = &fb->urbs[fb->urb_next];
+		if (urb->busy) {
+			ret = fastboot_urb_reap(fb);
+			if (ret < 0)
+				goto err;
+			continue;
+		}
 
-		ret = fastboot_write(fb, data + offset, xfer);
-		if (ret < 0)
-			goto out;
+		xfer = MIN(len, FASTBOOT_URB_SIZE - fb->xfer_fill);
 
-		offset += xfer;
+		memcpy(urb->buf + fb->xfer_fill, data, xfer);
+		fb->xfer_fill += xfer;
+		fb->xfer_left -= xfer;
+		data += xfer;
 		len -= xfer;
+
+		if (fb->xfer_fill == FASTBOOT_URB_SIZE || !fb->xfer_left) {
+			ret = fastboot_urb_submit(fb, urb, fb->xfer_fill);
+			if (ret < 0)
+				goto err;
+
+			fb->xfer_fill = 0;
+		}
+	}
+
+	return 0;
+
+err:
+	fb->xfer_failed = true;
+	return -1;
+}
+
+/**
+ * fastboot_download_finish() - conclude a streaming download
+ * @fb:		fastboot handle
+ *
+ * Return: 0 on success, negative on failure
+ */
+int fastboot_download_finish(struct fastboot *fb)
+{
+	int ret = -1;
+
+	if (fb->xfer_failed)
+		goto out;
+
+	if (fb->xfer_left) {
+		warnx("download ended %zu bytes short", fb->xfer_left);
+		goto out;
+	}
+
+	while (fb->urb_busy) {
+		ret = fastboot_urb_reap(fb);
+		if (ret < 0)
+			goto out;
 	}
 
 	ret = fastboot_read(fb, NULL, 0);
 
 out:
-	free(buf);
+	if (fb->urbs) {
+		fastboot_urbs_discard(fb);
+		fastboot_urbs_free(fb);
+	}
+
 	return ret;
 }
 
+int fastboot_download(struct fastboot *fb, const void *data, size_t len)
+{
+	int ret;
+
+	ret = fastboot_download_start(fb, len);
+	if (!ret)
+		fastboot_download_write(fb, data, len);
+
+	return fastboot_download_finish(fb);
+}
+
 int fastboot_boot(struct fastboot *fb)
 {
 	char buf[80];
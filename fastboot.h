@@ -12,6 +12,12 @@ struct fastboot_ops {
 struct fastboot *fastboot_open(const char *serial, struct fastboot_ops *ops, void *);
 int fastboot_getvar(struct fastboot *fb, const char *var, char *buf, size_t len);
 int fastboot_download(struct fastboot *fb, const void *data, size_t len);
+void fastboot_hold(struct fastboot *fb);
+void fastboot_release(struct fastboot *fb);
+void fastboot_set_queue_depth(struct fastboot *fb, unsigned int depth);
+int fastboot_download_start(struct fastboot *fb, size_t len);
+int fastboot_download_write(struct fastboot *fb, const void *data, size_t len);
+int fastboot_download_finish(struct fastboot *fb);
 int fastboot_boot(struct fastboot *fb);
 int fastboot_erase(struct fastboot *fb, const char *partition);
 int fastboot_set_active(struct fastboot *fb, const char *active);
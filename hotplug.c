@@ -0,0 +1,496 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/socket.h>
+
+#include <err.h>
+#include <errno.h>
+#include <libudev.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cdba-server.h"
+#include "hotplug.h"
+#include "list.h"
+
+/*
+ * The hotplug index tracks USB devices by serial number, from a single udev
+ * monitor, and notifies the subscribers of a serial as devices come and go.
+ *
+ * A session served by the daemon subscribes through its hotplug socket and
+ * the daemon's index notifies it over the same socket, so only the session of
+ * the affected board is woken up by a uevent. A standalone session runs an
+ * index of its own.
+ *
+ * Messages on the hotplug socket are SOCK_SEQPACKET datagrams:
+ *   'S' <serial>			subscribe, session to daemon
+ *   'A' <serial> '\0' <devpath> '\0' <devnode>
+ *					device added, daemon to session
+ *   'R' <serial> '\0' <devpath>	device removed, daemon to session
+ */
+
+#define HOTPLUG_MSG_MAX		(3 * PATH_MAX + 3)
+
+struct hotplug_entry {
+	struct list_head node;
+
+	char *serial;
+	char *devpath;
+	char *devnode;
+};
+
+struct hotplug_sub {
+	struct list_head node;
+
+	char *serial;
+
+	/* Session of the daemon, or -1 for a subscriber within this process */
+	int fd;
+	void (*cb)(const char *devpath, const char *devnode, void *data);
+	void *data;
+};
+
+static struct list_head hotplug_entries = LIST_INIT(hotplug_entries);
+static struct list_head hotplug_subs = LIST_INIT(hotplug_subs);
+
+static struct udev *hotplug_udev;
+static struct udev_monitor *hotplug_mon;
+
+/* Connection to the daemon's index, in a session served by the daemon */
+static int hotplug_daemon_fd = -1;
+
+static struct hotplug_entry *hotplug_find(const char *devpath)
+{
+	struct hotplug_entry *entry;
+
+	list_for_each_entry(entry, &hotplug_entries, node) {
+		if (!strcmp(entry->devpath, devpath))
+			return entry;
+	}
+
+	return NULL;
+}
+
+static int hotplug_send(int fd, char type, const char *serial,
+			const char *devpath, const char *devnode)
+{
+	char msg[HOTPLUG_MSG_MAX];
+	size_t len;
+
+	len = snprintf(msg, sizeof(msg), "%c%s", type, serial) + 1;
+	if (len < sizeof(msg))
+		len += snprintf(msg + len, sizeof(msg) - len, "%s", devpath) + 1;
+	if (devnode && len < sizeof(msg))
+		len += snprintf(msg + len, sizeof(msg) - len, "%s", devnode);
+	if (len > sizeof(msg))
+		return 0;
+
+	return send(fd, msg, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+static void hotplug_notify(struct hotplug_sub *sub, struct hotplug_entry *entry,
+			   bool added)
+{
+	int ret;
+
+	if (sub->fd < 0) {
+		sub->cb(entry->devpath, added ? entry->devnode : NULL, sub->data);
+		return;
+	}
+
+	ret = hotplug_send(sub->fd, added ? 'A' : 'R', entry->serial, entry->devpath,
+			   added ? entry->devnode : NULL);
+	if (ret >= 0 || errno == EPIPE)
+		return;
+
+	/*
+	 * A session that doesn't keep up with its notifications must not stall
+	 * the daemon; shut its hotplug socket down, which makes the daemon drop
+	 * the session's subscriptions on the next poll.
+	 */
+	warn("dropping hotplug subscriber for %s", sub->serial);
+	shutdown(sub->fd, SHUT_RDWR);
+}
+
+static void hotplug_changed(struct hotplug_entry *entry, bool added)
+{
+	struct hotplug_sub *sub;
+
+	list_for_each_entry(sub, &hotplug_subs, node) {
+		if (!strcmp(sub->serial, entry->serial))
+			hotplug_notify(sub, entry, added);
+	}
+}
+
+static void hotplug_add(struct udev_device *dev)
+{
+	struct hotplug_entry *entry;
+	const char *devpath;
+	const char *devnode;
+	const char *serial;
+
+	serial = udev_device_get_sysattr_value(dev, "serial");
+	devpath = udev_device_get_devpath(dev);
+	devnode = udev_device_get_devnode(dev);
+	if (!serial || !devpath || !devnode)
+		return;
+
+	/* A repeated add replaces the previous entry */
+	entry = hotplug_find(devpath);
+	if (entry) {
+		list_del(&entry->node);
+		free(entry->serial);
+		free(entry->devpath);
+		free(entry->devnode);
+		free(entry);
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		err(1, "failed to allocate hotplug entry");
+
+	entry->serial = strdup(serial);
+	entry->devpath = strdup(devpath);
+	entry->devnode = strdup(devnode);
+
+	list_add(&hotplug_entries, &entry->node);
+
+	hotplug_changed(entry, true);
+}
+
+static void hotplug_remove(struct udev_device *dev)
+{
+	struct hotplug_entry *entry;
+	const char *devpath;
+
+	devpath = udev_device_get_devpath(dev);
+	if (!devpath)
+		return;
+
+	entry = hotplug_find(devpath);
+	if (!entry)
+		return;
+
+	list_del(&entry->node);
+
+	hotplug_changed(entry, false);
+
+	free(entry->serial);
+	free(entry->devpath);
+	free(entry->devnode);
+	free(entry);
+}
+
+/**
+ * hotplug_index_event() - process a uevent from the index's udev monitor
+ */
+void hotplug_index_event(void)
+{
+	struct udev_device *dev;
+	const char *action;
+
+	dev = udev_monitor_receive_device(hotplug_mon);
+	if (!dev)
+		return;
+
+	action = udev_device_get_action(dev);
+	if (action && !strcmp(action, "add"))
+		hotplug_add(dev);
+	else if (action && !strcmp(action, "remove"))
+		hotplug_remove(dev);
+
+	udev_device_unref(dev);
+}
+
+/**
+ * hotplug_index_open() - start indexing USB devices
+ * @serial:	only index devices with this serial number, or NULL for all
+ *
+ * Return: fd of the udev monitor, to be polled for hotplug_index_event()
+ */
+int hotplug_index_open(const char *serial)
+{
+	struct udev_list_entry *first, *item;
+	struct udev_enumerate *udev_enum;
+	struct udev_device *dev;
+
+	hotplug_udev = udev_new();
+	if (!hotplug_udev)
+		err(1, "udev_new() failed");
+
+	/* Interfaces don't carry a serial number, leave them out */
+	hotplug_mon = udev_monitor_new_from_netlink(hotplug_udev, "udev");
+	udev_monitor_filter_add_match_subsystem_devtype(hotplug_mon, "usb", "usb_device");
+	udev_monitor_enable_receiving(hotplug_mon);
+
+	udev_enum = udev_enumerate_new(hotplug_udev);
+	udev_enumerate_add_match_subsystem(udev_enum, "usb");
+	if (serial)
+		udev_enumerate_add_match_sysattr(udev_enum, "serial", serial);
+	udev_enumerate_scan_devices(udev_enum);
+
+	first = udev_enumerate_get_list_entry(udev_enum);
+	udev_list_entry_foreach(item, first) {
+		dev = udev_device_new_from_syspath(hotplug_udev,
+						   udev_list_entry_get_name(item));
+		if (!dev)
+			continue;
+
+		hotplug_add(dev);
+		udev_device_unref(dev);
+	}
+
+	udev_enumerate_unref(udev_enum);
+
+	return udev_monitor_get_fd(hotplug_mon);
+}
+
+static struct hotplug_sub *hotplug_sub_add(const char *serial, int fd)
+{
+	struct hotplug_sub *sub;
+
+	sub = calloc(1, sizeof(*sub));
+	if (!sub)
+		err(1, "failed to allocate hotplug subscription");
+
+	sub->serial = strdup(serial);
+	sub->fd = fd;
+
+	list_add(&hotplug_subs, &sub->node);
+
+	return sub;
+}
+
+/**
+ * hotplug_index_serve() - handle a request from a session's hotplug socket
+ * @fd:		daemon end of the session's hotplug socket
+ *
+ * Return: 0 on success, -1 once the session has gone away
+ */
+int hotplug_index_serve(int fd)
+{
+	struct hotplug_entry *entry;
+	struct hotplug_sub *sub;
+	char msg[HOTPLUG_MSG_MAX];
+	ssize_t n;
+
+	n = recv(fd, msg, sizeof(msg) - 1, MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	else if (n <= 0)
+		return -1;
+
+	msg[n] = '\0';
+
+	if (msg[0] != 'S')
+		return 0;
+
+	sub = hotplug_sub_add(msg + 1, fd);
+
+	/* Report the devices already present */
+	list_for_each_entry(entry, &hotplug_entries, node) {
+		if (!strcmp(entry->serial, sub->serial))
+			hotplug_notify(sub, entry, true);
+	}
+
+	return 0;
+}
+
+/**
+ * hotplug_index_drop() - drop the subscriptions of a session
+ * @fd:		daemon end of the session's hotplug socket
+ */
+void hotplug_index_drop(int fd)
+{
+	struct hotplug_sub *tmp;
+	struct hotplug_sub *sub;
+
+	list_for_each_entry_safe(sub, tmp, &hotplug_subs, node) {
+		if (sub->fd != fd)
+			continue;
+
+		list_del(&sub->node);
+		free(sub->serial);
+		free(sub);
+	}
+}
+
+/**
+ * hotplug_index_reset() - forget the index inherited from the daemon
+ *
+ * A session forked from the daemon inherits the daemon's entries and the
+ * subscriptions of other sessions, none of which it may act upon. Releasing
+ * the udev monitor also closes its fd.
+ */
+void hotplug_index_reset(void)
+{
+	struct hotplug_entry *entry, *next_entry;
+	struct hotplug_sub *sub, *next_sub;
+
+	list_for_each_entry_safe(entry, next_entry, &hotplug_entries, node) {
+		list_del(&entry->node);
+		free(entry->serial);
+		free(entry->devpath);
+		free(entry->devnode);
+		free(entry);
+	}
+
+	list_for_each_entry_safe(sub, next_sub, &hotplug_subs, node) {
+		list_del(&sub->node);
+		free(sub->serial);
+		free(sub);
+	}
+
+	if (hotplug_mon) {
+		udev_monitor_unref(hotplug_mon);
+		hotplug_mon = NULL;
+	}
+
+	if (hotplug_udev) {
+		udev_unref(hotplug_udev);
+		hotplug_udev = NULL;
+	}
+}
+
+/**
+ * hotplug_use_daemon() - subscribe through the daemon's index
+ * @fd:		session end of the hotplug socket
+ */
+void hotplug_use_daemon(int fd)
+{
+	hotplug_daemon_fd = fd;
+}
+
+static int hotplug_daemon_data(int fd, void *data)
+{
+	char msg[HOTPLUG_MSG_MAX];
+	struct hotplug_sub *sub;
+	const char *devnode;
+	const char *devpath;
+	const char *serial;
+	const char *end;
+	ssize_t n;
+
+	n = recv(fd, msg, sizeof(msg) - 1, MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	else if (n <= 0) {
+		warnx("lost connection to hotplug index");
+		watch_del_readfd(fd);
+		return 0;
+	}
+
+	msg[n] = '\0';
+
+	/* Each field is nul terminated, the last one by msg[n] */
+	end = msg + n;
+	serial = msg + 1;
+	devpath = serial + strlen(serial) + 1;
+	if (devpath >= end)
+		return 0;
+	devnode = devpath + strlen(devpath) + 1;
+	if (devnode >= end)
+		devnode = NULL;
+
+	switch (msg[0]) {
+	case 'A':
+		if (!devnode)
+			return 0;
+		break;
+	case 'R':
+		devnode = NULL;
+		break;
+	default:
+		return 0;
+	}
+
+	list_for_each_entry(sub, &hotplug_subs, node) {
+		if (sub->fd < 0 && sub->cb && !strcmp(sub->serial, serial))
+			sub->cb(devpath, devnode, sub->data);
+	}
+
+	return 0;
+}
+
+static int hotplug_local_data(int fd, void *data)
+{
+	hotplug_index_event();
+
+	return 0;
+}
+
+/**
+ * hotplug_subscribe() - get notified about devices with a given serial number
+ * @serial:	USB serial number
+ * @cb:		invoked with the devnode of added devices, NULL for removal
+ * @data:	context passed to @cb
+ *
+ * Devices already present are reported right away, or as the daemon's index
+ * responds when the session is served by the daemon.
+ */
+void hotplug_subscribe(const char *serial,
+		       void (*cb)(const char *devpath, const char *devnode, void *data),
+		       void *data)
+{
+	struct hotplug_entry *entry;
+	struct hotplug_sub *sub;
+	char msg[HOTPLUG_MSG_MAX];
+	size_t len;
+	int fd;
+
+	if (hotplug_daemon_fd < 0 && !hotplug_mon) {
+		fd = hotplug_index_open(serial);
+		watch_add_readfd(fd, hotplug_local_data, NULL);
+	}
+
+	sub = hotplug_sub_add(serial, -1);
+	sub->cb = cb;
+	sub->data = data;
+
+	if (hotplug_daemon_fd >= 0) {
+		len = snprintf(msg, sizeof(msg), "S%s", serial);
+		if (len >= sizeof(msg))
+			errx(1, "serial \"%s\" too long", serial);
+
+		if (send(hotplug_daemon_fd, msg, len, MSG_NOSIGNAL) < 0)
+			err(1, "failed to subscribe to hotplug index");
+
+		watch_add_readfd(hotplug_daemon_fd, hotplug_daemon_data, NULL);
+		return;
+	}
+
+	list_for_each_entry(entry, &hotplug_entries, node) {
+		if (!strcmp(entry->serial, serial))
+			hotplug_notify(sub, entry, true);
+	}
+}
@@ -0,0 +1,15 @@
+#ifndef __HOTPLUG_H__
+#define __HOTPLUG_H__
+
+void hotplug_subscribe(const char *serial,
+		       void (*cb)(const char *devpath, const char *devnode, void *data),
+		       void *data);
+void hotplug_use_daemon(int fd);
+
+int hotplug_index_open(const char *serial);
+void hotplug_index_event(void);
+int hotplug_index_serve(int fd);
+void hotplug_index_drop(int fd);
+void hotplug_index_reset(void);
+
+#endif
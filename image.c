@@ -0,0 +1,416 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "image.h"
+
+/*
+ * Open an anonymous spill file in @tmpdir. A linkable spill file can later be
+ * given a name using image_link(), on file systems without O_TMPFILE support
+ * it's created with a temporary name, which is kept until then.
+ */
+static int image_spill_open(struct image *image, const char *tmpdir, bool linkable)
+{
+	char path[PATH_MAX];
+	int flags = O_TMPFILE | O_RDWR | O_CLOEXEC;
+	int fd;
+
+	if (!linkable)
+		flags |= O_EXCL;
+
+	fd = open(tmpdir, flags, 0600);
+	if (fd >= 0)
+		return fd;
+
+	/* Fall back for file systems without O_TMPFILE support */
+	snprintf(path, sizeof(path), "%s/cdba-image-XXXXXX", tmpdir);
+	fd = mkostemp(path, O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (linkable)
+		image->path = strdup(path);
+	else
+		unlink(path);
+
+	return fd;
+}
+
+/**
+ * image_alloc() - allocate staging area for an incoming image
+ * @size:	announced size of the image, or 0 if unknown
+ * @dir:	directory to spill the image to, or NULL for the default
+ *
+ * Images of known size, up to IMAGE_RESIDENT_MAX, are staged in a memfd which
+ * is allocated and mapped once. Larger images, or images of unknown size, are
+ * spilled to an unlinked file in $TMPDIR (or /var/tmp), so that the amount of
+ * memory pinned by a session is bounded. Spill files of known size are mapped
+ * read-only up front, so that the staged data can be consumed while the image
+ * is still being received.
+ *
+ * If @dir is specified the image is always spilled to a file in @dir, this
+ * allows the caller to link the completed image into @dir using image_link().
+ *
+ * Return: image staging object, or NULL with errno set on failure
+ */
+struct image *image_alloc(size_t size, const char *dir)
+{
+	struct image *image;
+	int prot = PROT_READ;
+	int saved_errno;
+	int ret;
+
+	image = calloc(1, sizeof(*image));
+	if (!image)
+		return NULL;
+
+	pthread_mutex_init(&image->lock, NULL);
+	pthread_cond_init(&image->cond, NULL);
+
+	image->size = size;
+
+	if (!dir && size && size <= IMAGE_RESIDENT_MAX) {
+		image->fd = memfd_create("cdba-image", MFD_CLOEXEC);
+		if (image->fd < 0) {
+			warn("failed to create image memfd");
+			goto err_free_image;
+		}
+
+		prot |= PROT_WRITE;
+	} else if (dir) {
+		image->fd = image_spill_open(image, dir, true);
+		if (image->fd < 0) {
+			warn("failed to create image spill file in %s", dir);
+			goto err_free_image;
+		}
+
+		image->spill = true;
+	} else {
+		dir = getenv("TMPDIR");
+		if (!dir)
+			dir = "/var/tmp";
+
+		image->fd = image_spill_open(image, dir, false);
+		if (image->fd < 0) {
+			warn("failed to create image spill file in %s", dir);
+			goto err_free_image;
+		}
+
+		image->spill = true;
+	}
+
+	if (!size)
+		return image;
+
+	ret = ftruncate(image->fd, size);
+	if (ret < 0) {
+		warn("failed to size image staging area");
+		goto err_free_image;
+	}
+
+	image->ptr = mmap(NULL, size, prot, MAP_SHARED, image->fd, 0);
+	if (image->ptr == MAP_FAILED) {
+		warn("failed to map image staging area");
+		goto err_free_image;
+	}
+
+	if (image->spill)
+		madvise(image->ptr, size, MADV_SEQUENTIAL);
+
+	image->mapped = size;
+
+	return image;
+
+err_free_image:
+	saved_errno = errno;
+	image_free(image);
+	errno = saved_errno;
+
+	return NULL;
+}
+
+/**
+ * image_open() - wrap a complete image file in an image object
+ * @fd:		file descriptor of the image, ownership is transferred
+ *
+ * Return: image object, or NULL on failure
+ */
+struct image *image_open(int fd)
+{
+	struct image *image;
+	struct stat sb;
+	int ret;
+
+	ret = fstat(fd, &sb);
+	if (ret < 0 || !sb.st_size) {
+		close(fd);
+		return NULL;
+	}
+
+	image = calloc(1, sizeof(*image));
+	if (!image)
+		err(1, "failed to allocate image");
+
+	pthread_mutex_init(&image->lock, NULL);
+	pthread_cond_init(&image->cond, NULL);
+
+	image->fd = fd;
+	image->spill = true;
+	image->size = sb.st_size;
+	image->len = sb.st_size;
+	image->complete = true;
+
+	image->ptr = mmap(NULL, image->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (image->ptr == MAP_FAILED) {
+		warn("failed to map image");
+		image->mapped = 0;
+		image_free(image);
+		return NULL;
+	}
+
+	madvise(image->ptr, image->size, MADV_SEQUENTIAL);
+	image->mapped = image->size;
+
+	return image;
+}
+
+static void image_publish(struct image *image, size_t len)
+{
+	pthread_mutex_lock(&image->lock);
+	image->len += len;
+	pthread_cond_broadcast(&image->cond);
+	pthread_mutex_unlock(&image->lock);
+}
+
+/**
+ * image_append() - append data to the staged image
+ * @image:	image staging object
+ * @data:	data to append
+ * @len:	number of bytes in @data
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int image_append(struct image *image, const void *data, size_t len)
+{
+	ssize_t n;
+
+	if (image->complete || image->failed)
+		return -EINVAL;
+
+	if (image->size && image->len + len > image->size)
+		return -EFBIG;
+
+	if (!image->spill) {
+		memcpy(image->ptr + image->len, data, len);
+		image_publish(image, len);
+		return 0;
+	}
+
+	while (len) {
+		n = pwrite(image->fd, data, len, image->len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0)
+			return -errno;
+
+		data += n;
+		len -= n;
+		image_publish(image, n);
+	}
+
+	return 0;
+}
+
+/**
+ * image_commit() - mark the staged image as complete
+ * @image:	image staging object
+ */
+void image_commit(struct image *image)
+{
+	pthread_mutex_lock(&image->lock);
+	image->complete = true;
+	pthread_cond_broadcast(&image->cond);
+	pthread_mutex_unlock(&image->lock);
+}
+
+/**
+ * image_abort() - mark the staged image as failed
+ * @image:	image staging object
+ *
+ * Consumers waiting for more data are woken up, the image must not be used
+ * once it has failed.
+ */
+void image_abort(struct image *image)
+{
+	pthread_mutex_lock(&image->lock);
+	image->failed = true;
+	pthread_cond_broadcast(&image->cond);
+	pthread_mutex_unlock(&image->lock);
+}
+
+/**
+ * image_failed() - check if staging of the image failed
+ * @image:	image staging object
+ */
+bool image_failed(struct image *image)
+{
+	bool failed;
+
+	pthread_mutex_lock(&image->lock);
+	failed = image->failed;
+	pthread_mutex_unlock(&image->lock);
+
+	return failed;
+}
+
+/**
+ * image_wait() - wait for data to be staged
+ * @image:	image staging object
+ * @offset:	offset up to which the caller has consumed the image
+ *
+ * Blocks until more than @offset bytes have been staged, or the image has
+ * been committed or aborted.
+ *
+ * Return: number of bytes staged
+ */
+size_t image_wait(struct image *image, size_t offset)
+{
+	size_t len;
+
+	pthread_mutex_lock(&image->lock);
+	while (image->len <= offset && !image->complete && !image->failed)
+		pthread_cond_wait(&image->cond, &image->lock);
+	len = image->len;
+	pthread_mutex_unlock(&image->lock);
+
+	return len;
+}
+
+/**
+ * image_data() - acquire a pointer to the staged image
+ * @image:	image staging object
+ *
+ * Spilled images are mapped read-only, so that the data can be handed to the
+ * consumer without being copied into private memory.
+ *
+ * Return: pointer to the image->len bytes of staged data, NULL on failure
+ */
+const void *image_data(struct image *image)
+{
+	void *ptr;
+
+	if (!image->len)
+		return NULL;
+
+	if (image->mapped >= image->len)
+		return image->ptr;
+
+	if (image->mapped)
+		munmap(image->ptr, image->mapped);
+
+	ptr = mmap(NULL, image->len, PROT_READ, MAP_SHARED, image->fd, 0);
+	if (ptr == MAP_FAILED) {
+		warn("failed to map staged image");
+		image->ptr = NULL;
+		image->mapped = 0;
+		return NULL;
+	}
+
+	madvise(ptr, image->len, MADV_SEQUENTIAL);
+
+	image->ptr = ptr;
+	image->mapped = image->len;
+
+	return ptr;
+}
+
+/**
+ * image_link() - give a spilled image a name
+ * @image:	image staging object, allocated with a directory
+ * @path:	path of the new name, in the directory of the spill file
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int image_link(struct image *image, const char *path)
+{
+	char src[64];
+	int ret;
+
+	if (image->path) {
+		ret = rename(image->path, path);
+		if (ret < 0)
+			return -errno;
+
+		free(image->path);
+		image->path = NULL;
+		return 0;
+	}
+
+	snprintf(src, sizeof(src), "/proc/self/fd/%d", image->fd);
+
+	ret = linkat(AT_FDCWD, src, AT_FDCWD, path, AT_SYMLINK_FOLLOW);
+	if (ret < 0)
+		return -errno;
+
+	return 0;
+}
+
+void image_free(struct image *image)
+{
+	if (!image)
+		return;
+
+	if (image->path) {
+		unlink(image->path);
+		free(image->path);
+	}
+
+	if (image->mapped)
+		munmap(image->ptr, image->mapped);
+
+	close(image->fd);
+
+	pthread_cond_destroy(&image->cond);
+	pthread_mutex_destroy(&image->lock);
+	free(image);
+}
@@ -0,0 +1,39 @@
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Images larger than this are spilled to disk rather than kept in memory */
+#define IMAGE_RESIDENT_MAX	(16 * 1024 * 1024)
+
+struct image {
+	int fd;
+	bool spill;
+	char *path;
+
+	void *ptr;
+	size_t mapped;
+
+	size_t size;
+	size_t len;
+	bool complete;
+	bool failed;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+struct image *image_alloc(size_t size, const char *dir);
+struct image *image_open(int fd);
+int image_append(struct image *image, const void *data, size_t len);
+void image_commit(struct image *image);
+void image_abort(struct image *image);
+bool image_failed(struct image *image);
+size_t image_wait(struct image *image, size_t offset);
+const void *image_data(struct image *image);
+int image_link(struct image *image, const char *path);
+void image_free(struct image *image);
+
+#endif
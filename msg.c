@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <endian.h>
+#include <err.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "msg.h"
+
+static unsigned int protocol = CDBA_PROTOCOL_V1;
+static size_t peer_len_max;
+
+/**
+ * msg_set_version() - switch framing to the negotiated protocol version
+ * @version:	protocol version
+ * @len_max:	largest payload accepted by the peer
+ *
+ * @len_max comes from the peer's hello, it's clamped to what version 1 frames
+ * already carry and to what any version 2 peer accepts.
+ */
+void msg_set_version(unsigned int version, size_t len_max)
+{
+	protocol = version;
+	peer_len_max = MIN(MAX(len_max, MSG_V1_BULK_LEN), MSG_V2_LEN_MAX);
+}
+
+unsigned int msg_version(void)
+{
+	return protocol;
+}
+
+/**
+ * msg_bulk_len() - payload size to use for bulk transfer frames
+ *
+ * Return: number of payload bytes per bulk frame
+ */
+size_t msg_bulk_len(void)
+{
+	if (protocol >= CDBA_PROTOCOL_V2)
+		return MIN(MSG_V2_BULK_LEN, peer_len_max);
+
+	return MSG_V1_BULK_LEN;
+}
+
+/**
+ * msg_hdr_encode() - encode a frame header for the current protocol
+ * @buf:	buffer of at least MSG_HDR_MAX bytes
+ * @type:	message type
+ * @len:	payload length
+ *
+ * Return: size of the encoded header
+ */
+size_t msg_hdr_encode(void *buf, unsigned int type, size_t len)
+{
+	struct msg_v2 v2;
+	struct msg v1;
+
+	if (protocol >= CDBA_PROTOCOL_V2) {
+		v2.type = type;
+		v2.len = htole32(len);
+		memcpy(buf, &v2, sizeof(v2));
+		return sizeof(v2);
+	}
+
+	v1.type = type;
+	v1.len = len;
+	memcpy(buf, &v1, sizeof(v1));
+	return sizeof(v1);
+}
+
+/**
+ * msg_hdr_decode() - decode the header of the next complete frame
+ * @circ:	receive buffer
+ * @hdr:	decoded header
+ *
+ * @hdr is always written; its size and len are zero if @circ doesn't hold a
+ * complete header yet, so that callers can tell that case apart from a frame
+ * whose payload is still incomplete.
+ *
+ * Return: true if a complete frame is available in @circ
+ */
+bool msg_hdr_decode(struct circ_buf *circ, struct msg_hdr *hdr)
+{
+	struct msg_v2 v2;
+	struct msg v1;
+
+	memset(hdr, 0, sizeof(*hdr));
+
+	if (protocol >= CDBA_PROTOCOL_V2) {
+		if (circ_peak(circ, &v2, sizeof(v2)) != sizeof(v2))
+			return false;
+
+		hdr->type = v2.type;
+		hdr->len = le32toh(v2.len);
+		hdr->size = sizeof(v2);
+	} else {
+		if (circ_peak(circ, &v1, sizeof(v1)) != sizeof(v1))
+			return false;
+
+		hdr->type = v1.type;
+		hdr->len = v1.len;
+		hdr->size = sizeof(v1);
+	}
+
+	return CIRC_AVAIL(circ) >= hdr->size + hdr->len;
+}
+
+/* Contiguous copy of a frame that wraps around the end of the receive ring */
+static char *msg_linear;
+static size_t msg_linear_size;
+
+/**
+ * msg_frame_next() - take the next complete frame from the receive buffer
+ * @circ:	receive buffer
+ * @hdr:	decoded header
+ * @data:	borrowed pointer to the payload
+ *
+ * The payload is handed out in place from @circ, or from a contiguous copy
+ * when it wraps around the end of a ring that isn't mirrored. It is valid
+ * until @circ is refilled or the next call to msg_frame_next().
+ *
+ * Return: true if a frame was taken from @circ
+ */
+bool msg_frame_next(struct circ_buf *circ, struct msg_hdr *hdr, const void **data)
+{
+	struct iovec iov[2];
+	int count;
+
+	if (!msg_hdr_decode(circ, hdr)) {
+		if (hdr->size && hdr->size + hdr->len >= circ->size)
+			errx(1, "frame of %zu bytes exceeds receive buffer", hdr->len);
+		return false;
+	}
+
+	count = circ_data_iov(circ, hdr->size, hdr->len, iov);
+	if (count == 1) {
+		*data = iov[0].iov_base;
+	} else {
+		if (hdr->len > msg_linear_size) {
+			msg_linear = realloc(msg_linear, hdr->len);
+			if (!msg_linear)
+				err(1, "failed to allocate frame buffer");
+			msg_linear_size = hdr->len;
+		}
+
+		memcpy(msg_linear, iov[0].iov_base, iov[0].iov_len);
+		memcpy(msg_linear + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+		*data = msg_linear;
+	}
+
+	circ_consume(circ, hdr->size + hdr->len);
+
+	return true;
+}
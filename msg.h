@@ -0,0 +1,27 @@
+#ifndef __MSG_H__
+#define __MSG_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "cdba.h"
+#include "circ_buf.h"
+
+/* Room for the frame header of any protocol version */
+#define MSG_HDR_MAX	sizeof(struct msg_v2)
+
+struct msg_hdr {
+	unsigned int type;
+	size_t len;
+	size_t size;
+};
+
+void msg_set_version(unsigned int version, size_t len_max);
+unsigned int msg_version(void);
+size_t msg_bulk_len(void);
+
+size_t msg_hdr_encode(void *buf, unsigned int type, size_t len);
+bool msg_hdr_decode(struct circ_buf *circ, struct msg_hdr *hdr);
+bool msg_frame_next(struct circ_buf *circ, struct msg_hdr *hdr, const void **data);
+
+#endif